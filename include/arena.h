@@ -0,0 +1,75 @@
+/**
+ * @file arena.h
+ * @author Jayden Dumouchel
+ * @date 9 Sep 2022
+ *
+ * @brief A bump allocator for scratch memory
+ *
+ * An arena hands out memory by bumping an offset into large blocks, and releases it
+ * all at once by resetting to an earlier mark. Processing takes its intermediate images
+ * and buffers from an arena, resetting it at the end of each filter, so that repeated
+ * runs reuse the same memory rather than going through malloc.
+ *
+ * When an arena outgrows its block a new one is chained on, sized for the allocation
+ * (and no smaller than the first). Once the arena is reset entirely the chain is
+ * consolidated into a single block large enough for all of them, after which runs of
+ * the same size make no further heap allocations.
+ */
+
+#ifndef _ED_ARENA_H
+#define _ED_ARENA_H
+
+#include "common.h"
+
+/// The alignment of every allocation (a cache line)
+#define ARENA_ALIGN 64
+
+struct arena;
+
+/**
+ * @brief Creates an arena.
+ *
+ * @param size The size of the initial block in bytes
+ * @return The arena, or NULL if allocation failed
+ */
+struct arena *arena_create(size_t size);
+
+/**
+ * @brief Frees an arena and all of its blocks.
+ */
+void arena_free(struct arena *arena);
+
+/**
+ * @brief Allocates uninitialized memory from an arena.
+ *
+ * Allocation is thread safe, so that the bands of a parallel loop may allocate their
+ * own buffers. Marking and resetting are not, and must happen outside of parallel loops.
+ *
+ * @param arena The arena to allocate from
+ * @param size The number of bytes
+ * @return ARENA_ALIGN aligned memory, valid until the arena is reset below it,
+ *         or NULL if allocation failed
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/**
+ * @brief Returns the current position of an arena, to later reset to.
+ */
+size_t arena_mark(struct arena *arena);
+
+/**
+ * @brief Releases every allocation made since `mark`.
+ *
+ * Resetting to 0 releases everything, consolidating the blocks if there are several.
+ *
+ * @param arena The arena to reset
+ * @param mark A position returned by arena_mark()
+ */
+void arena_reset(struct arena *arena, size_t mark);
+
+/**
+ * @brief Returns the total size of the blocks held by an arena, in bytes.
+ */
+size_t arena_capacity(struct arena *arena);
+
+#endif
@@ -15,7 +15,9 @@
 
 #include "common.h"
 #include "image.h"
+#include "memstats.h"
 #include "processing.h"
+#include "threadpool.h"
 
 typedef enum operation {
     SOBEL,
@@ -36,4 +38,5 @@ void edge_detect_canny(struct image *img,
                        float blur, 
                        unsigned char thresh1,
                        unsigned char thresh2);
+void edge_detect_canny_auto(struct image *img, float blur);
 #endif
@@ -0,0 +1,98 @@
+/**
+ * @file fft.h
+ * @author Jayden Dumouchel
+ * @date 9 Sep 2022
+ *
+ * @brief FFT based convolution
+ *
+ * Provides a small, self contained radix-2 FFT and a convolution backend built on it.
+ * Direct convolution costs w*h operations per pixel for a w x h kernel, whereas the
+ * FFT costs roughly log2 of the transform size, making it the better choice for large
+ * kernels. image_convolve() chooses between the two through fft_convolve_preferred().
+ *
+ * Plans (twiddle factors and bit reversal tables) are built once per transform size
+ * and reused for the lifetime of the process.
+ */
+
+#ifndef _ED_FFT_H
+#define _ED_FFT_H
+
+#include "common.h"
+#include "image.h"
+#include "processing.h"
+
+/**
+ * A complex number, kept as a plain pair of floats to avoid the overhead of
+ * C99 complex multiplication (which must handle infinities and NaNs).
+ */
+struct fft_complex {
+    float re;
+    float im;
+};
+
+/**
+ * The precomputed tables for transforms of a given size.
+ */
+struct fft_plan {
+    int n;                          /// The transform size (a power of 2)
+    int *rev;                       /// The bit reversal permutation of [0, n)
+    struct fft_complex *twiddle;    /// e^(-2*pi*i*k/n) for k in [0, n/2)
+};
+
+/**
+ * @brief Returns the (cached) plan for transforms of size n.
+ *
+ * @param n The transform size, must be a power of 2
+ * @return The plan, or NULL if n is invalid or allocation failed
+ */
+struct fft_plan *fft_plan_get(int n);
+
+/**
+ * @brief Applies an unnormalized, in place 1D FFT.
+ *
+ * @param plan The plan for the transform size
+ * @param data The plan->n values to transform
+ * @param inverse Non-zero to apply the inverse transform (without the 1/n scaling)
+ */
+void fft_1d(struct fft_plan *plan, struct fft_complex *data, int inverse);
+
+/**
+ * @brief Applies an unnormalized, in place 2D FFT to an n x n row major array.
+ *
+ * Columns are transformed a whole row at a time, keeping memory accesses sequential.
+ *
+ * @param plan The plan for the transform size
+ * @param data The n*n values to transform
+ * @param inverse Non-zero to apply the inverse transform (without the 1/n^2 scaling)
+ */
+void fft_2d(struct fft_plan *plan, struct fft_complex *data, int inverse);
+
+/**
+ * @brief Decides whether convolving with `k` is cheaper through the FFT.
+ *
+ * Compares the per pixel cost of direct convolution (a multiply-add per tap) against
+ * that of the block FFT convolution, for the transform size fft_convolve() would use.
+ * Separable kernels are always cheaper to apply directly. Kernels with fewer taps than
+ * 15x15 always take the direct path too, as it is exact where the FFT is not.
+ *
+ * @param k The kernel
+ * @return Non-zero if fft_convolve() should be used
+ */
+int fft_convolve_preferred(struct kernel *k);
+
+/**
+ * @brief Convolves the inner image of `src` into `dest` through the FFT.
+ *
+ * Computes the same result as image_convolve(), using overlap-save over square blocks.
+ * Pairs of blocks share a complex transform, as the input and kernel are real.
+ * Due to float rounding in the transforms, results may differ from direct convolution
+ * by 1 grey level wherever the exact result lies within ~1e-3 of a rounding boundary.
+ *
+ * @param dest Receives the convolved inner image, same dimensions as src
+ * @param src The image to convolve
+ * @param k The kernel
+ * @return 1 on success, 0 on allocation failure
+ */
+int fft_convolve(struct image *dest, struct image *src, struct kernel *k);
+
+#endif
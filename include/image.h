@@ -18,22 +18,93 @@
 
 #include "common.h"
 
+/// The alignment of image buffers and of their row strides (a cache line, and a multiple
+/// of every vector width used)
+#define IMAGE_ALIGN 64
+
+/**
+ * An image, or a view of a region of another image's buffer.
+ *
+ * Pixels are addressed through the origin and stride rather than the width, so that a
+ * view (of the inner image, or any region of interest) shares its parent's buffer.
+ * Use image_row() or image_inner_row() to locate a row.
+ *
+ * Images allocated here are IMAGE_ALIGN aligned, with the stride rounded up to a
+ * multiple of IMAGE_ALIGN, so every row starts on a cache line.
+ */
 struct image {
-    int width;
-    int height;
+    int width;              /// The width in pixels, padding included
+    int height;             /// The height in pixels, padding included
     int channels;
-    int padding;
-    unsigned char *data;
+    int padding;            /// The padding on each side, included in width and height
+    unsigned char *data;    /// The buffer the pixels lie in
+    size_t offset;          /// The offset of the top left pixel (the origin) into data
+    size_t stride;          /// The distance between the starts of consecutive rows, in bytes
+    struct image *parent;   /// The image a view shares data with, NULL if data is owned
 };
 
+/**
+ * @brief Returns the row stride of an allocated image, rounded up to IMAGE_ALIGN bytes.
+ */
+static inline size_t image_stride(int width, int channels){
+    return ((size_t) width * channels + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+}
+
+/**
+ * @brief Returns row y of an image, counting from the top of its padding.
+ */
+static inline unsigned char *image_row(struct image *img, int y){
+    return &img->data[img->offset + (size_t) y * img->stride];
+}
+
+/**
+ * @brief Returns row y of the inner image, starting at its first (unpadded) pixel.
+ */
+static inline unsigned char *image_inner_row(struct image *img, int y){
+    return image_row(img, y + img->padding) + (size_t) img->padding * img->channels;
+}
+
 int image_write_to_disk(struct image *img, const char *path);
 
+/**
+ * @brief Frees an image, and its data unless it is a view (never with free()).
+ *
+ * Images are allocated through memstats.h, which keeps a header ahead of each buffer.
+ */
 void image_free(struct image *img);
 
 struct image *image_load(const char *path);
 
 struct image *image_clone(struct image *img);
 
+/**
+ * @brief Allocates a new (black) image.
+ *
+ * Intended for intermediate buffers, such as the destination of image_convolve_into().
+ *
+ * @param width The width in pixels (padding included)
+ * @param height The height in pixels (padding included)
+ * @param channels The number of channels
+ * @param padding The padding on each side, included in width and height
+ */
+struct image *image_create(int width, int height, int channels, int padding);
+
+/**
+ * @brief Fills `view` with a view of a region of `img`, sharing its data.
+ *
+ * No pixels are copied: filters applied to the view write through to `img`, which
+ * must outlive the view. The view has no padding of its own.
+ *
+ * @param view Receives the view
+ * @param img The image to view, which may itself be a view
+ * @param x The left edge of the region, counting from the left of the padding
+ * @param y The top edge of the region, counting from the top of the padding
+ * @param width The width of the region
+ * @param height The height of the region
+ * @return 1 on success, 0 if the region does not lie within img
+ */
+int image_view(struct image *view, struct image *img, int x, int y, int width, int height);
+
 struct image *image_to_1channel(struct image *img);
 
 /**
@@ -41,6 +112,9 @@ struct image *image_to_1channel(struct image *img);
  *
  * A new image is generated after padding (as it has an increased footprint) using
  * black as a pad color. This is primarily to allow for convolution to run unimpeded.
+ * When img is a view with room for the padding around it in its parent (such as one
+ * returned by image_unpad()), the padded image is instead a view of the parent, whose
+ * surrounding pixels make up the padding.
  *
  * @param img The image to pad.
  * @param amount The amount of padding to add *to each side*.
@@ -51,6 +125,7 @@ struct image *image_pad(struct image *img, int amount);
  * @brief Generates an unpadded version of an image.
  *
  * Unpadding can only unpad an amount <= the current padding of the image.
+ * The result is a view of img's data (see image_view()), so no pixels are copied.
  *
  * @param img The image to unpad
  * @param amount The amount of padding to remove.
@@ -79,4 +154,15 @@ int image_unpad_into(struct image *dest, struct image *src);
  */
 int image_merge_add(struct image *img_a, struct image *img_b);
 
+/**
+ * @brief Stores the sum of img_a and img_b into dest.
+ *
+ * As image_merge_add() but writing the result into `dest`, which may be either input.
+ *
+ * @param dest The image receiving min(a+b, 255) of each byte
+ * @param img_a The first image to merge
+ * @param img_b The second image to merge
+ */
+int image_merge_add_into(struct image *dest, struct image *img_a, struct image *img_b);
+
 #endif
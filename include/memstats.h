@@ -0,0 +1,119 @@
+/**
+ * @file memstats.h
+ * @author Jayden Dumouchel
+ * @date 9 Sep 2022
+ *
+ * @brief Heap allocation accounting
+ *
+ * Every buffer the program allocates (images, kernels, arena blocks, FFT plans and the
+ * buffers of stb_image) goes through the wrappers here, which record the bytes held and
+ * the number of allocations made. Accounting is split by named stages, pushed and popped
+ * around each step of processing, so that the memory a pipeline needs can be read off
+ * per step when sizing the machines it runs on.
+ *
+ * Most working memory is taken from arenas (see arena.h), whose blocks are allocated once
+ * and then reused, so arenas also report the bytes taken from and released to them. These
+ * are accounted separately from the heap, showing the memory each stage works in.
+ */
+
+#ifndef _ED_MEMSTATS_H
+#define _ED_MEMSTATS_H
+
+#include "common.h"
+
+/// The most stages recorded, later ones are accounted to the stage they are nested in
+#define MEM_STATS_MAX_STAGES 32
+
+/**
+ * The accounting of a named stage.
+ */
+struct mem_stage {
+    const char *name;
+    int depth;              /// The number of stages it was nested in when first pushed
+    size_t allocs;          /// The allocations made while it was the innermost stage
+    size_t bytes;           /// The bytes allocated while it was the innermost stage
+    size_t current;         /// The bytes allocated while it was innermost and not yet freed
+    size_t peak;            /// The most bytes held overall while it (or a nested stage) ran
+    size_t arena;           /// The bytes taken from arenas while it was the innermost stage
+    size_t arena_peak;      /// The most bytes in use in arenas while it (or a nested stage) ran
+};
+
+/**
+ * The accounting of the whole process.
+ */
+struct mem_stats {
+    size_t allocs;          /// Every allocation made
+    size_t frees;
+    size_t bytes;           /// Every byte allocated
+    size_t current;         /// The bytes held
+    size_t peak;            /// The most bytes held at once
+    size_t arena;           /// Every byte taken from arenas
+    size_t arena_current;   /// The bytes in use in arenas
+    size_t arena_peak;      /// The most bytes in use in arenas at once
+    int stages;             /// The number of stages, in the order first pushed
+    struct mem_stage stage[MEM_STATS_MAX_STAGES];
+};
+
+/**
+ * @brief Allocates memory as malloc() does, accounting for it.
+ */
+void *mem_malloc(size_t size);
+
+/**
+ * @brief Allocates aligned memory as aligned_alloc() does, accounting for it.
+ *
+ * @param alignment A power of 2
+ * @param size The number of bytes
+ */
+void *mem_aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief Resizes memory from mem_malloc() as realloc() does, accounting for it.
+ *
+ * Memory from mem_aligned_alloc() may not be resized.
+ */
+void *mem_realloc(void *ptr, size_t size);
+
+/**
+ * @brief Frees memory from any of the allocators here (or NULL).
+ */
+void mem_free(void *ptr);
+
+/**
+ * @brief Accounts for `bytes` taken from an arena, including any alignment and the unused
+ * end of a block skipped over.
+ */
+void mem_stats_arena_alloc(size_t bytes);
+
+/**
+ * @brief Accounts for `bytes` released to an arena by resetting it.
+ */
+void mem_stats_arena_release(size_t bytes);
+
+/**
+ * @brief Begins a stage, nested in the current one.
+ *
+ * Pushing a name again (compared as a string) continues its accounting. Stages nested
+ * more than MEM_STATS_MAX_STAGES deep are accounted to the deepest one, each still
+ * ended by its own mem_stats_pop().
+ *
+ * @param name The stage's name, which must outlive the accounting (a literal)
+ */
+void mem_stats_push(const char *name);
+
+/**
+ * @brief Ends the innermost stage.
+ */
+void mem_stats_pop(void);
+
+/**
+ * @brief Copies the accounting so far into `stats`.
+ */
+void mem_stats_get(struct mem_stats *stats);
+
+/**
+ * @brief Prints the accounting of every stage and the totals, as a table.
+ */
+void mem_stats_print(FILE *stream);
+
+#endif
@@ -9,6 +9,9 @@
  * the bytes.
  *
  * Kernel can be created/destroyed here to allow for robust usage of convolution.
+ *
+ * Every filter accepts views (see image_view()), so a region of interest can be
+ * processed in place within a larger image.
  */
 
 #ifndef _ED_PROCESSING_H
@@ -17,33 +20,215 @@
 #include <limits.h>
 
 #include "common.h"
+#include "arena.h"
 #include "image.h"
 
+/// The shift applied after multiplying by kernel.div_mul
+#define KERNEL_DIV_SHIFT 23
+
 /**
  * A kernel stores the information needed to perform a convolution.
  *
  * Kernels can be created easily using kernel_create().
+ * Kernels created through kernel_create_separable() additionally carry their 1D
+ * factors, allowing convolution to be applied as a horizontal and a vertical pass.
+ *
+ * Kernels of whole numbers (such as Sobel) are detected on creation and are given an
+ * integer copy of their values. These are convolved with integer arithmetic, producing
+ * results identical to the float path.
  */
 struct kernel {
     int width;          /// The width of the matrix
     int height;         /// The height of the matrix
     float divisor;      /// All values are divided by this value after summing
+    float *row;         /// The horizontal factor (width values), NULL if not separable
+    float *col;         /// The vertical factor (height values), NULL if not separable
+    int *ivalues;       /// The values as integers (row major), NULL if not an integer kernel
+    int idivisor;       /// The divisor as an integer, for integer kernels
+    int abs_sum;        /// The sum of the absolute values, bounding any integer sum
+    unsigned int div_mul;   /// 2^KERNEL_DIV_SHIFT / (2*idivisor) rounded up, 0 if inexact
     float *values[];    /// Stores the actual values of the kernel (as 2d array)
 };
 
+/**
+ * How pixels beyond the edges of an image are sampled, given as the samples to the
+ * left of a row "abcd" (edge at |).
+ */
+enum border_mode {
+    BORDER_CONSTANT,    /// 000|abcd, black
+    BORDER_REPLICATE,   /// aaa|abcd, the edge pixel repeated
+    BORDER_REFLECT,     /// cba|abcd, mirrored about the edge (the edge pixel included)
+    BORDER_WRAP,        /// bcd|abcd, the opposite edge
+};
+
+/**
+ * @brief Sets the border mode used by convolution and blurs, BORDER_CONSTANT by default.
+ *
+ * Non-maximum suppression and hysteresis always treat pixels beyond the edges as
+ * non-edges.
+ *
+ * @param mode The border mode
+ */
+void processing_set_border(enum border_mode mode);
+
+/**
+ * @brief Returns the border mode used by convolution and blurs.
+ */
+enum border_mode processing_get_border(void);
+
+/// The initial size of the scratch arena created when none is set
+#define PROCESSING_ARENA_SIZE (1 << 20)
+
+/**
+ * @brief Sets the arena processing takes its intermediate images and buffers from.
+ *
+ * Every filter resets the arena to where it found it before returning, so an arena can
+ * be reused for a whole batch of images. Once it has grown to fit the largest run,
+ * processing makes no further heap allocations. The arena must outlive its use here.
+ *
+ * @param arena The arena, or NULL to use one created (and kept) on first use
+ */
+void processing_set_arena(struct arena *arena);
+
+/**
+ * @brief Returns the arena processing takes its intermediates from.
+ */
+struct arena *processing_get_arena(void);
+
+/**
+ * How gradient filters combine the horizontal and vertical gradients into a magnitude.
+ */
+enum gradient_norm {
+    GRADIENT_L1,        /// |gx| + |gy|
+    GRADIENT_L2,        /// sqrt(gx^2 + gy^2)
+};
+
+/**
+ * @brief Sets the magnitude used by gradient filters, GRADIENT_L1 by default.
+ *
+ * @param norm The magnitude
+ */
+void processing_set_gradient_norm(enum gradient_norm norm);
+
+/**
+ * @brief Returns the magnitude used by gradient filters.
+ */
+enum gradient_norm processing_get_gradient_norm(void);
+
+/**
+ * How the hysteresis threshold connects weak pixels to strong ones.
+ */
+enum hysteresis_mode {
+    HYSTERESIS_FLOOD,       /// A serial flood fill from every strong pixel
+    HYSTERESIS_UNION_FIND,  /// Connected components of runs, labelled in parallel bands
+    HYSTERESIS_DILATE,      /// Word parallel dilation of 1 bit planes, 64 pixels at a time
+};
+
+/**
+ * @brief Sets the algorithm of the hysteresis threshold, HYSTERESIS_FLOOD by default.
+ *
+ * Both produce identical results. The flood fill is serial and holds 2 bits per pixel, and
+ * a word per weak pixel. Union-find labels runs of weak and strong pixels, merging them
+ * across bands with atomic operations, so it scales with the thread count. It holds
+ * 13 bytes per run (a few per edge pixel, on thinned edges), and a word per row.
+ * Dilation grows the strong plane into the weak one a row of 64 bit words at a time, in
+ * sweeps alternating down and up that revisit only the words beside those changed. It
+ * holds 2 bits per pixel, and takes a sweep for each turn back up or down an edge makes.
+ * A streamed filter_canny() dilating thresholds into the planes as rows arrive; with the
+ * other algorithms it holds its thinned magnitude whole (a byte per pixel) beforehand.
+ *
+ * @param mode The algorithm
+ */
+void processing_set_hysteresis(enum hysteresis_mode mode);
+
+/**
+ * @brief Returns the algorithm of the hysteresis threshold.
+ */
+enum hysteresis_mode processing_get_hysteresis(void);
+
+/**
+ * @brief Sets the scratch memory filter_two_pass() and filter_canny() should stay within.
+ *
+ * A Canny blur with sigma up to GAUSSIAN_RECURSIVE_SIGMA streams in a few rows per thread
+ * regardless of the budget, holding only its hysteresis planes (2 bits per pixel) whole,
+ * or its thinned magnitude (a byte per pixel) unless dilating.
+ *
+ * When the intermediates for the whole image would exceed the budget, these filters
+ * process the image in horizontal strips sized to fit it. Each strip is extended by a halo
+ * of the rows its stages read beyond it, so the result is identical to an untiled run.
+ * A Canny blur with sigma above GAUSSIAN_RECURSIVE_SIGMA reaches every row of the image,
+ * and strips cannot wrap around the image, so the budget is ignored (with a warning) for
+ * those and with BORDER_WRAP.
+ *
+ * The budget covers the intermediates only, not the image itself. The hysteresis masks of
+ * filter_canny() (2 bits per pixel, and a stack of a word per weak pixel) cover the whole
+ * image at once, as edges may connect across any distance. They are not held at the same
+ * time as the strips.
+ *
+ * @param bytes The budget in bytes, 0 (the default) for no limit
+ */
+void processing_set_max_memory(size_t bytes);
+
+/**
+ * @brief Returns the scratch memory budget, 0 if there is none.
+ */
+size_t processing_get_max_memory(void);
+
+/**
+ * @brief Maps an index along a row or column of n pixels through a border mode.
+ *
+ * @param i The index, which may lie beyond either edge
+ * @param n The number of pixels
+ * @param mode The border mode
+ * @return The index of the pixel sampled, or -1 for a black (constant) sample
+ */
+int border_index(int i, int n, enum border_mode mode);
+
 /** 
  * @brief Convolve an image using the passed kernel
  *
  * Convolution is applied per byte using as the sum of the kernel affected on its 
  * correspondent neighbours.
  *
- * The image must be appropriately padded and may only have a single channel
+ * Only the inner image (excluding any padding) is convolved, and the padding is
+ * neither read nor written. Pixels beyond the edges of the inner image are sampled
+ * through the border mode set by processing_set_border(). The image may only have a
+ * single channel.
+ *
+ * Large non-separable kernels (15x15 taps and up) are convolved through the FFT (see fft.h)
+ * when it is estimated to be cheaper, in which case results may differ by 1 grey level.
  *
  * @param img The image to convolve in place
  * @param k The kernel used for convolution
  */
 int image_convolve(struct image *img, struct kernel *k);
 
+/**
+ * @brief Convolve an image into a destination image using the passed kernel
+ *
+ * As image_convolve() but writing the result into the inner image of `dest`, avoiding
+ * the temporary image image_convolve() allocates. Pipelines can ping-pong between a
+ * fixed set of buffers this way.
+ *
+ * @param dest Receives the result, with the same dimensions and padding as src
+ *             (and distinct memory)
+ * @param src The image to convolve
+ * @param k The kernel used for convolution
+ */
+int image_convolve_into(struct image *dest, struct image *src, struct kernel *k);
+
+/**
+ * @brief Overrides the tile size used by image_convolve().
+ *
+ * Convolution processes the image in 2D tiles, so that the source rows under the kernel
+ * stay in cache regardless of the image width. By default the tile size is derived from
+ * the detected L2 cache size and the kernel.
+ *
+ * @param width The tile width in pixels, 0 to derive it from the cache size
+ * @param height The tile height in pixels, 0 to derive it from the cache size
+ */
+void processing_set_tile_size(int width, int height);
+
 /**
  * @brief Converts an rgb(a) image into a grayscale image.
  *
@@ -109,15 +294,25 @@ int filter_threshold(struct image *img, unsigned char value);
  * by the higher `t1` but kept by `t2` *provided* that they connected to values left
  * undiscarded by `t1`.
  *
+ * Edges are grown by flooding from each strong pixel through its 8-connected weak
+ * neighbours, visiting every pixel once however long or winding the edges are, or as
+ * connected components in parallel (see processing_set_hysteresis()).
+ *
  * @param img The image to apply the filter to
  * @param t1 The larger threshold
  * @param t2 The smaller threshold
  */
 int filter_hysteresis_threshold(struct image *img, unsigned char t1, unsigned char t2);
 
+/// Blurs with a larger sigma are applied recursively rather than with a (truncated) kernel
+#define GAUSSIAN_RECURSIVE_SIGMA 2.0
+
 /**
  * @brief Applies a gaussian blur to an image.
  *
+ * When sigma exceeds GAUSSIAN_RECURSIVE_SIGMA a size x size kernel would truncate
+ * the blur, so filter_gaussian_recursive() is applied instead.
+ *
  * @param img The image to apply the blur.
  * @param size The size of the filter (size X size kernel)
  * @param sigma The blur strength
@@ -125,12 +320,34 @@ int filter_hysteresis_threshold(struct image *img, unsigned char t1, unsigned ch
 int filter_gaussian(struct image *img, int size, float sigma);
 
 /**
- * @brief Applies 2 separate convolutions and merges the result.
+ * @brief Applies a gaussian blur recursively, at a cost independent of sigma.
+ *
+ * Implements the Young and van Vliet (1995) recursive filter as a forward and backward
+ * pass over each row and then each column. Beyond the edges of the image is sampled
+ * through the border mode, as with convolution. The approximation is accurate for
+ * sigma >= 0.5.
+ *
+ * @param img The image to apply the blur to (in place)
+ * @param sigma The blur strength
+ */
+int filter_gaussian_recursive(struct image *img, float sigma);
+
+/**
+ * @brief Applies a pair of gradient kernels and stores the gradient magnitude.
+ *
+ * Both gradients are kept signed (as int16 planes) until they are combined through
+ * the norm set by processing_set_gradient_norm(), so negative responses count towards
+ * the magnitude and the direction used for thinning spans the full circle.
+ *
+ * Pairs of 2x2 or 3x3 integer kernels (Sobel, Scharr and Roberts Cross) are fused:
+ * both gradients are taken from a single read of each neighbourhood, and combined
+ * into the magnitude (and direction) in the same sweep, without the gradient planes.
+ * Other kernels go through the planes, with identical rounding.
  *
  * @param img The image to convolve.
- * @param k1 The first kernel to apply.
- * @param k2 The second kernel to apply.
- * @param thinned A boolean to apply thinning
+ * @param k1 The horizontal gradient kernel (gx).
+ * @param k2 The vertical gradient kernel (gy).
+ * @param thinned A boolean to apply thinning (non-maximum suppression)
  */
 int filter_two_pass(struct image *img, struct kernel *k1, struct kernel *k2, int thinned);
 
@@ -141,6 +358,14 @@ int filter_two_pass(struct image *img, struct kernel *k1, struct kernel *k2, int
  *      blur -> sobel -> edge thinning -> hysteresis threshold
  * As such, given my poor implementations, this is a fairly intensive process.
  *
+ * With sigma up to GAUSSIAN_RECURSIVE_SIGMA (a blur by kernel), each band of rows is
+ * streamed through every stage in rings of a few rows. With HYSTERESIS_DILATE it is
+ * thresholded straight into the planes of the dilation; with the other hysteresis modes
+ * the thinned magnitude is held whole and thresholded after the last row. The result is
+ * identical to applying the stages in turn. Its allocations are accounted (see
+ * memstats.h) to the stages "stream" and "hysteresis". Larger sigmas apply the stages in
+ * turn over whole images (or strips), accounted to "blur", "gradient" and "hysteresis".
+ *
  * @param img The image to apply to
  * @param sigma The weight of the gaussian blur
  * @param t1 The stricter (larger) threshold
@@ -148,10 +373,27 @@ int filter_two_pass(struct image *img, struct kernel *k1, struct kernel *k2, int
  */
 int filter_canny(struct image *img, float sigma, unsigned char t1, unsigned char t2);
 
+/**
+ * @brief Applies Canny edge detection as filter_canny() does, choosing the thresholds.
+ *
+ * A histogram of the gradient magnitude (256 bins, one per value) is counted as the
+ * gradients are computed. The stricter threshold is then chosen by Otsu's method, splitting
+ * the non-zero magnitudes where the variance between the two sides is greatest, and the
+ * softer is half of it. Neither is chosen below 1, nor the stricter below 2. The histogram is only complete once every gradient is, so the thinned
+ * magnitude of the whole image is held (a byte per pixel) in place of the hysteresis
+ * planes of a streamed filter_canny(), and thresholded with the hysteresis mode set.
+ *
+ * @param img The image to apply to
+ * @param sigma The weight of the gaussian blur
+ * @param t1 Receives the stricter threshold chosen, unless NULL
+ * @param t2 Receives the softer threshold chosen, unless NULL
+ */
+int filter_canny_auto(struct image *img, float sigma, unsigned char *t1, unsigned char *t2);
+
 /**
  * @brief Allocates and populates a new kernel from a 2d array.
  *
- * Note, the kernel MUST be freed after use (preferrably via kernel_free()
+ * Note, the kernel MUST be freed after use via kernel_free(), not free()
  * @param w Width of the kernel
  * @param h Height of the kernel
  * @param div The divisor, every value is divided by this after summing
@@ -159,6 +401,22 @@ int filter_canny(struct image *img, float sigma, unsigned char t1, unsigned char
  */
 struct kernel *kernel_create(int h, int w, float div, float vals[h][w]);
 
+/**
+ * @brief Allocates a separable kernel from its horizontal and vertical factors.
+ *
+ * The 2d values are populated as the outer product `col[y] * row[x]`, so the kernel
+ * remains usable anywhere a regular kernel is. image_convolve() will however apply
+ * it as two 1D passes, costing O(w+h) per pixel rather than O(w*h).
+ *
+ * Note, the kernel MUST be freed after use via kernel_free(), not free()
+ * @param h Height of the kernel
+ * @param w Width of the kernel
+ * @param div The divisor, every value is divided by this after summing
+ * @param row The horizontal factor
+ * @param col The vertical factor
+ */
+struct kernel *kernel_create_separable(int h, int w, float div, float row[w], float col[h]);
+
 /**
  * @brief Frees a kernel and its allocated data.
  * @param k The kernel to free
@@ -171,6 +429,7 @@ void kernel_free(struct kernel *k);
  * Note: I am waaay out of my depth calculating this bullshit.
  * I naively implemented the commonly cited formula for 2D Gaussian Filters
  *      1/(2*pi*sigma^2) * e^-((x^2+y^2)/(2sigma^2))
+ * which factors into two 1D gaussians, so the kernel is built as separable.
  *
  * @param size The matrix dimensions (size x size )
  * @param weight The strength of the kernel (sigma)
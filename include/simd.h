@@ -0,0 +1,75 @@
+/**
+ * @file simd.h
+ * @author Jayden Dumouchel
+ * @date 9 Sep 2022
+ *
+ * @brief Vectorized processing routines
+ *
+ * Provides SIMD implementations of hot processing loops. The instruction set used
+ * is chosen once at startup by querying the CPU (cpuid), with the scalar code in
+ * `processing.c` remaining as both the fallback and the reference implementation.
+ * Every routine here produces bit-identical results to its scalar counterpart.
+ */
+
+#ifndef _ED_SIMD_H
+#define _ED_SIMD_H
+
+#include "common.h"
+#include "processing.h"
+
+/**
+ * The instruction set extensions usable by the vectorized routines, in increasing order.
+ */
+enum simd_level {
+    SIMD_NONE,
+    SIMD_SSE41,
+    SIMD_AVX2,
+};
+
+/**
+ * @brief Returns the instruction set currently used for dispatch.
+ */
+enum simd_level simd_get_level(void);
+
+/**
+ * @brief Restricts dispatch to an instruction set.
+ *
+ * Levels above what the CPU supports are clamped to the detected level. This
+ * is mostly useful to compare the vectorized routines against the scalar reference.
+ *
+ * @param level The highest instruction set to use
+ * @return The level actually in use
+ */
+enum simd_level simd_set_level(enum simd_level level);
+
+/**
+ * @brief Convolves a run of pixels in a single row with a 3x3 kernel.
+ *
+ * Pixels are processed in blocks of 16. A partial last block overlaps the one before
+ * it rather than being left to scalar code, so only runs shorter than 16 pixels are
+ * left for the caller to complete. dest must not overlap the source rows.
+ *
+ * @param dest The first output byte
+ * @param rows The 3 source rows, each pointing at the left tap of the first output
+ * @param k The 3x3 kernel
+ * @param count The number of pixels requested
+ * @return The number of pixels written (count, or 0 if it is below 16 or no SIMD is
+ *         available)
+ */
+int simd_convolve_row_3x3(unsigned char *dest, unsigned char *rows[3], 
+                          struct kernel *k, int count);
+
+/**
+ * @brief Convolves a run of pixels in a single row with a 3x3 integer kernel.
+ *
+ * As simd_convolve_row_3x3() but using the kernel's integer values. Sums are
+ * accumulated in 16 bit lanes when the kernel's values allow it (16 pixels per
+ * AVX2 instruction), otherwise in 32 bit lanes. Kernels without an exact
+ * reciprocal multiplier are left entirely to the caller.
+ *
+ * @return The number of pixels written (count, or 0 if it is below 16 or unsupported)
+ */
+int simd_convolve_row_3x3_int(unsigned char *dest, unsigned char *rows[3], 
+                              struct kernel *k, int count);
+
+#endif
@@ -0,0 +1,58 @@
+/**
+ * @file threadpool.h
+ * @author Jayden Dumouchel
+ * @date 9 Sep 2022
+ *
+ * @brief A process wide pool of worker threads
+ *
+ * Processing is parallelized by splitting the rows of an image into bands, each
+ * processed by a thread of the pool. The threads are created once and reused for
+ * every parallel loop. Every band writes to its own rows, so results are identical
+ * regardless of the thread count.
+ */
+
+#ifndef _ED_THREADPOOL_H
+#define _ED_THREADPOOL_H
+
+#include "common.h"
+
+/**
+ * A function processing the band of rows [begin, end).
+ */
+typedef void (*threadpool_fn)(void *ctx, int begin, int end);
+
+/**
+ * @brief Sets the number of threads used for processing, (re)starting the pool.
+ *
+ * If never called, the pool starts on first use with one thread per online CPU.
+ *
+ * @param threads The number of threads (including the calling thread),
+ *                or <= 0 for one per online CPU
+ * @return The number of threads in use
+ */
+int threadpool_set_threads(int threads);
+
+/**
+ * @brief Returns the number of threads used for processing.
+ */
+int threadpool_get_threads(void);
+
+/**
+ * @brief Runs `fn` over the range [begin, end), split into contiguous bands.
+ *
+ * The bands are distributed over the pool (the calling thread included) and the call
+ * blocks until every band is complete. Calls made from within a band run serially.
+ *
+ * @param begin The first row
+ * @param end One past the last row
+ * @param fn The function to apply to each band
+ * @param ctx Passed through to `fn`
+ */
+void threadpool_run_bands(int begin, int end, threadpool_fn fn, void *ctx);
+
+/**
+ * @brief Stops and joins the worker threads.
+ */
+void threadpool_shutdown(void);
+
+#endif
@@ -0,0 +1,127 @@
+#include "../include/arena.h"
+#include "../include/memstats.h"
+
+#include <pthread.h>
+
+struct arena_block {
+    struct arena_block *next;
+    size_t base;                // The total size of the blocks before this one
+    size_t size;
+    size_t used;
+    unsigned char *data;        // ARENA_ALIGN aligned, within the same allocation
+};
+
+struct arena {
+    struct arena_block *first;
+    struct arena_block *current;    // The block allocations are made from
+    size_t block_size;              // The size of the first block, the least any other is given
+    pthread_mutex_t lock;
+};
+
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+static struct arena_block *arena_block_create(size_t base, size_t size){
+    size = ALIGN_UP(MAX(size, (size_t) ARENA_ALIGN));
+    struct arena_block *block = mem_malloc(ALIGN_UP(sizeof(struct arena_block)) + size
+                                           + ARENA_ALIGN);
+    if (!block) { return NULL; }
+    block->next = NULL;
+    block->base = base;
+    block->size = size;
+    block->used = 0;
+    block->data = (unsigned char *) ALIGN_UP((size_t)((unsigned char *) block
+                                             + sizeof(struct arena_block)));
+    return block;
+}
+
+static void arena_free_blocks(struct arena_block *block){
+    while (block){
+        struct arena_block *next = block->next;
+        mem_free(block);
+        block = next;
+    }
+}
+
+struct arena *arena_create(size_t size){
+    struct arena *arena = mem_malloc(sizeof(struct arena));
+    if (!arena) { return NULL; }
+    if (!(arena->first = arena_block_create(0, size))) { mem_free(arena); return NULL; }
+    arena->current = arena->first;
+    arena->block_size = arena->first->size;
+    pthread_mutex_init(&arena->lock, NULL);
+    return arena;
+}
+
+void arena_free(struct arena *arena){
+    if (!arena) { return; }
+    arena_free_blocks(arena->first);
+    pthread_mutex_destroy(&arena->lock);
+    mem_free(arena);
+}
+
+void *arena_alloc(struct arena *arena, size_t size){
+    size = ALIGN_UP(MAX(size, (size_t) 1));
+    pthread_mutex_lock(&arena->lock);
+
+    struct arena_block *block = arena->current;
+    if (block->size - block->used < size){
+        // Move on to the next block, replacing the rest of the chain if it is too small.
+        // Blocks are sized to the request rather than grown geometrically, so that a large
+        // image followed by small buffers takes little more memory than they need.
+        if (block->next && block->next->size >= size) { block = block->next; }
+        else {
+            arena_free_blocks(block->next);
+            block->next = arena_block_create(block->base + block->size,
+                                             MAX(size, arena->block_size));
+            block = block->next;
+        }
+        if (block) { block->used = 0; }
+    }
+
+    void *ptr = NULL;
+    if (block){
+        // Accounted from the previous position, so the end of a block skipped counts too
+        size_t from = arena_mark(arena);
+        arena->current = block;
+        ptr = block->data + block->used;
+        block->used += size;
+        mem_stats_arena_alloc(arena_mark(arena) - from);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+size_t arena_mark(struct arena *arena){
+    return arena->current->base + arena->current->used;
+}
+
+void arena_reset(struct arena *arena, size_t mark){
+    size_t from = arena_mark(arena);
+    // Consolidate a chain of blocks into one, so the next run fits without growing.
+    // The chain is released first, so that the old and new blocks are never both held.
+    if (!mark && arena->first->next){
+        size_t capacity = arena_capacity(arena);
+        arena_free_blocks(arena->first->next);
+        arena->first->next = NULL;
+        struct arena_block *block = arena_block_create(0, capacity);
+        if (block){
+            arena_free_blocks(arena->first);
+            arena->first = block;
+        }
+    }
+
+    // Find the block holding the mark, the earliest if it lies on a boundary
+    struct arena_block *block = arena->first;
+    while (block->next && mark > block->base + block->size) { block = block->next; }
+    block->used = MIN(mark - block->base, block->size);
+    arena->current = block;
+    if (from > arena_mark(arena)) { mem_stats_arena_release(from - arena_mark(arena)); }
+}
+
+size_t arena_capacity(struct arena *arena){
+    size_t capacity = 0;
+    for (struct arena_block *block = arena->first; block; block = block->next){
+        capacity += block->size;
+    }
+    return capacity;
+}
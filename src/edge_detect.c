@@ -1,7 +1,13 @@
 #include "../include/edge_detect.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+
 // Outputs information on how to use the program through a CLI
-#define PRINT_USAGE() printf("usage: %s input_file output_file\n", PROGRAM_NAME)
+#define PRINT_USAGE() printf("usage: %s input_file output_file [--threads N] [--border MODE] [--magnitude l1|l2] [--hysteresis MODE] [--max-memory SIZE] [--stats] [--METHOD] [ARGS]\n", \
+                            PROGRAM_NAME)
 
 static char PROGRAM_NAME[PATH_MAX+1] = {0};
 
@@ -11,10 +17,117 @@ int parse_long(char* str, long* out_int){
             &index_ptr) == 1 && (unsigned long) index_ptr == strlen(str));
 }
 
+// Parses a size in bytes, with an optional K, M or G suffix (powers of 1024)
+int parse_size(char* str, size_t* out_size){
+    // strtoull() would also accept leading whitespace and signs
+    if (!isdigit((unsigned char) str[0])) { return 0; }
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (errno == ERANGE) { return 0; }
+
+    int shift = 0;
+    if (*end){
+        if (end[1]) { return 0; }
+        switch (*end){
+            case 'K': case 'k': shift = 10; break;
+            case 'M': case 'm': shift = 20; break;
+            case 'G': case 'g': shift = 30; break;
+            default: return 0;
+        }
+    }
+    if (size > (ULLONG_MAX >> shift) || (size << shift) > SIZE_MAX) { return 0; }
+    *out_size = (size_t)(size << shift);
+    return 1;
+}
+
 int main(int argc, char **argv) {
     // copy the executed name into PROGRAM_NAME for usage printing
     strncpy(PROGRAM_NAME, argv[0], PATH_MAX);
 
+    // Handle options, stripping them from argv to leave only the positional args
+    int threads = 0, stats = 0;
+    int argn = 1;
+    for (int i = 1; i < argc; ++i){
+        if (!strncmp(argv[i], "--threads", ARG_MAX)){
+            long threads_in;
+            if (i+1 >= argc || !parse_long(argv[i+1], &threads_in) || threads_in < 0){
+                fprintf(stderr, "%s\tFailed to parse 'threads' argument.\n", ERR_TXT);
+                exit(EXIT_FAILURE);
+            }
+            threads = (int) threads_in;
+            ++i;
+            continue;
+        }
+        if (!strncmp(argv[i], "--border", ARG_MAX)){
+            static const char *modes[] = {
+                [BORDER_CONSTANT] = "constant", [BORDER_REPLICATE] = "replicate",
+                [BORDER_REFLECT] = "reflect", [BORDER_WRAP] = "wrap",
+            };
+            int mode = -1;
+            for (int m = 0; i+1 < argc && m < (int)(sizeof(modes)/sizeof(*modes)); ++m){
+                if (!strncmp(argv[i+1], modes[m], ARG_MAX)) { mode = m; }
+            }
+            if (mode < 0){
+                fprintf(stderr, "%s\tFailed to parse 'border' argument "
+                        "(constant, replicate, reflect or wrap).\n", ERR_TXT);
+                exit(EXIT_FAILURE);
+            }
+            processing_set_border((enum border_mode) mode);
+            ++i;
+            continue;
+        }
+        if (!strncmp(argv[i], "--magnitude", ARG_MAX)){
+            static const char *norms[] = { [GRADIENT_L1] = "l1", [GRADIENT_L2] = "l2" };
+            int norm = -1;
+            for (int n = 0; i+1 < argc && n < (int)(sizeof(norms)/sizeof(*norms)); ++n){
+                if (!strncmp(argv[i+1], norms[n], ARG_MAX)) { norm = n; }
+            }
+            if (norm < 0){
+                fprintf(stderr, "%s\tFailed to parse 'magnitude' argument (l1 or l2).\n", ERR_TXT);
+                exit(EXIT_FAILURE);
+            }
+            processing_set_gradient_norm((enum gradient_norm) norm);
+            ++i;
+            continue;
+        }
+        if (!strncmp(argv[i], "--hysteresis", ARG_MAX)){
+            static const char *modes[] = { 
+                [HYSTERESIS_FLOOD] = "flood", [HYSTERESIS_UNION_FIND] = "union-find",
+                [HYSTERESIS_DILATE] = "dilate",
+            };
+            int mode = -1;
+            for (int m = 0; i+1 < argc && m < (int)(sizeof(modes)/sizeof(*modes)); ++m){
+                if (!strncmp(argv[i+1], modes[m], ARG_MAX)) { mode = m; }
+            }
+            if (mode < 0){
+                fprintf(stderr, "%s\tFailed to parse 'hysteresis' argument "
+                        "(flood, union-find or dilate).\n", ERR_TXT);
+                exit(EXIT_FAILURE);
+            }
+            processing_set_hysteresis((enum hysteresis_mode) mode);
+            ++i;
+            continue;
+        }
+        if (!strncmp(argv[i], "--max-memory", ARG_MAX)){
+            size_t max_memory;
+            if (i+1 >= argc || !parse_size(argv[i+1], &max_memory)){
+                fprintf(stderr, "%s\tFailed to parse 'max-memory' argument "
+                        "(bytes, or with a K, M or G suffix).\n", ERR_TXT);
+                exit(EXIT_FAILURE);
+            }
+            processing_set_max_memory(max_memory);
+            ++i;
+            continue;
+        }
+        if (!strncmp(argv[i], "--stats", ARG_MAX)){
+            stats = 1;
+            continue;
+        }
+        argv[argn++] = argv[i];
+    }
+    argc = argn;
+
     // Handle args
     char *input_path = NULL, *output_path = NULL;
     if (argc >= 3){
@@ -29,7 +142,10 @@ int main(int argc, char **argv) {
 
     // Load image from disk into memory
     struct image *in_img;
-    if (!(in_img = image_load(input_path))){
+    mem_stats_push("load");
+    in_img = image_load(input_path);
+    mem_stats_pop();
+    if (!in_img){
         fprintf(stderr, 
                 "%s\tFailed to load image from path: \n\t\t%s\n", 
                 ERR_TXT, input_path);
@@ -37,12 +153,14 @@ int main(int argc, char **argv) {
     }
     printf("%s\tImage loaded:\n\t\twidth: %i\n\t\theight: %i\n\t\tchannels: %i\n",
             INFO_TXT, in_img->width, in_img->height, in_img->channels);
+    printf("%s\tUsing %i thread(s)\n", INFO_TXT, threadpool_set_threads(threads));
  
 
 
     // Convert to grayscale if needed
     struct image *img;
     if (in_img->channels > 1) { 
+        mem_stats_push("grayscale");
         printf("%s\tConverting to grayscale...\n", INFO_TXT);
         // Convert image to grayscale
         if (!filter_grayscale(in_img)){
@@ -57,9 +175,11 @@ int main(int argc, char **argv) {
             exit(EXIT_FAILURE);
         }
         image_free(in_img);
+        mem_stats_pop();
     }
     else { img = in_img; }
     
+    mem_stats_push("filter");
     // TODO fix this abomination, argument handling should be done at the top
     //      and lump similar algos together. Flags sould be added for passing parameters
     if (argc == 3) { 
@@ -120,31 +240,47 @@ int main(int argc, char **argv) {
             float t1 = 0.0;
             float t2 = 0.0;
 
-            if (argc == 7){
-                char *p;
-                sigma = strtof(argv[4], &p);
-                t1 = strtof(argv[5], &p);
-                t2 = strtof(argv[6], &p);
-            }
-            else if (argc != 4){
-                fprintf(stderr, "%s\tCanny requires 3 arguments (blur, thresh1, tresh2)\n", 
-                        ERR_TXT);
-                exit(EXIT_FAILURE);
+            // Automatic thresholds take an optional blur, defaulting to that of edge_detect()
+            if ((argc == 5 || argc == 6) && !strncmp(argv[4], "auto", ARG_MAX)){
+                sigma = 1.0;
+                if (argc == 6){
+                    char *p;
+                    sigma = strtof(argv[5], &p);
+                }
+                edge_detect_canny_auto(img, sigma);
             }
+            else {
+                if (argc == 7){
+                    char *p;
+                    sigma = strtof(argv[4], &p);
+                    t1 = strtof(argv[5], &p);
+                    t2 = strtof(argv[6], &p);
+                }
+                else if (argc != 4){
+                    fprintf(stderr, "%s\tCanny requires 3 arguments (blur, thresh1, tresh2) "
+                            "or auto [blur]\n", ERR_TXT);
+                    exit(EXIT_FAILURE);
+                }
 
-            edge_detect_canny(img, sigma, t1, t2);
+                edge_detect_canny(img, sigma, t1, t2);
+            }
         }
 
     }
+    mem_stats_pop();
 
     // Write image in memory to disk
     printf("%s\tWriting to file: \"%s\"...\n", INFO_TXT, output_path);
-    if (!image_write_to_disk(img, output_path)){
+    mem_stats_push("write");
+    int written = image_write_to_disk(img, output_path);
+    mem_stats_pop();
+    if (!written){
         printf("failed.\n");
         fprintf(stderr, "%s\tCould not write image to disk.\n", ERR_TXT);
         exit(EXIT_FAILURE);
     }
     image_free(img);
+    if (stats) { mem_stats_print(stdout); }
     exit(EXIT_SUCCESS);
 }
 
@@ -194,6 +330,11 @@ void edge_detect_canny(struct image *img,
     filter_canny(img, blur, thresh1, thresh2);
 }
 
+void edge_detect_canny_auto(struct image *img, float blur){
+    printf("%s\tApplying Canny edge detection with automatic thresholds\n", INFO_TXT);
+    filter_canny_auto(img, blur, NULL, NULL);
+}
+
 void edge_detect_cross(struct image *img, unsigned char thresh){
     printf("%s\tApplying Roberts Cross filter...\n", INFO_TXT);
     filter_cross(img);
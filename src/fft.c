@@ -0,0 +1,271 @@
+#include "../include/fft.h"
+#include "../include/memstats.h"
+#include "../include/threadpool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Plans are cached per power of 2, up to transforms of 2^FFT_MAX_LOG2 values
+#define FFT_MAX_LOG2 12
+
+// The smallest and largest block sizes considered for convolution
+#define FFT_MIN_BLOCK 32
+#define FFT_MAX_BLOCK 512
+
+// The cost of one FFT point per pass relative to one multiply-add of direct convolution.
+// A point of a pass is half a complex butterfly, plus the spectrum product amortized.
+// Measured on a 1024x1024 image, where a 7x7 float kernel takes ~1 ns per tap directly
+// and ~21 ns per pixel through 64 point blocks.
+#define FFT_COST_PER_POINT 1.5
+// The cost of a multiply-add of direct convolution with an integer kernel, relative to float,
+// as measured for kernels of FFT_MIN_KERNEL and up (smaller ones vary between 0.6 and 1.5)
+#define FFT_INT_TAP_COST 0.6
+// The smallest kernel (in taps, as a square side) convolved through the FFT. The FFT is
+// faster from around 5x5, but only accurate to a grey level, so smaller kernels are kept
+// on the exact direct path.
+#define FFT_MIN_KERNEL 15
+
+static struct fft_plan *plans[FFT_MAX_LOG2 + 1];
+static pthread_mutex_t plans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int log2_int(int n){
+    int log2n = 0;
+    while ((1 << log2n) < n) { log2n++; }
+    return log2n;
+}
+
+struct fft_plan *fft_plan_get(int n){
+    int log2n = log2_int(n);
+    if (n < 1 || (1 << log2n) != n || log2n > FFT_MAX_LOG2) { return NULL; }
+
+    pthread_mutex_lock(&plans_lock);
+    struct fft_plan *plan = plans[log2n];
+    if (!plan && (plan = mem_malloc(sizeof(struct fft_plan)))){
+        plan->n = n;
+        plan->rev = mem_malloc(sizeof(int) * n);
+        plan->twiddle = mem_malloc(sizeof(struct fft_complex) * MAX(n/2, 1));
+        if (!plan->rev || !plan->twiddle){
+            mem_free(plan->rev); mem_free(plan->twiddle); mem_free(plan);
+            plan = NULL;
+        }
+        else {
+            for (int i = 0; i < n; ++i){
+                int r = 0;
+                for (int b = 0; b < log2n; ++b){ r |= ((i >> b) & 1) << (log2n - 1 - b); }
+                plan->rev[i] = r;
+            }
+            // Computed in double so that every twiddle is correctly rounded
+            for (int i = 0; i < n/2; ++i){
+                double angle = -2.0 * M_PI * i / n;
+                plan->twiddle[i] = (struct fft_complex) { (float) cos(angle), (float) sin(angle) };
+            }
+            plans[log2n] = plan;
+        }
+    }
+    pthread_mutex_unlock(&plans_lock);
+    return plan;
+}
+
+void fft_1d(struct fft_plan *plan, struct fft_complex *data, int inverse){
+    int n = plan->n;
+    for (int i = 0; i < n; ++i){
+        int r = plan->rev[i];
+        if (r > i) { struct fft_complex t = data[i]; data[i] = data[r]; data[r] = t; }
+    }
+
+    float sign = inverse ? -1.0f : 1.0f;
+    for (int len = 2; len <= n; len <<= 1){
+        int half = len/2, step = n/len;
+        for (int i = 0; i < n; i += len){
+            for (int j = 0; j < half; ++j){
+                struct fft_complex w = plan->twiddle[j*step];
+                w.im *= sign;
+                struct fft_complex *a = &data[i+j], *b = &data[i+j+half];
+                float t_re = b->re*w.re - b->im*w.im;
+                float t_im = b->re*w.im + b->im*w.re;
+                b->re = a->re - t_re; b->im = a->im - t_im;
+                a->re += t_re; a->im += t_im;
+            }
+        }
+    }
+}
+
+void fft_2d(struct fft_plan *plan, struct fft_complex *data, int inverse){
+    int n = plan->n;
+    for (int y = 0; y < n; ++y){ fft_1d(plan, &data[(size_t) y*n], inverse); }
+
+    // The column transforms, applied to whole rows: swap rows into bit reversed order,
+    // then each butterfly combines two rows element wise
+    for (int i = 0; i < n; ++i){
+        int r = plan->rev[i];
+        if (r <= i) { continue; }
+        struct fft_complex *a = &data[(size_t) i*n], *b = &data[(size_t) r*n];
+        for (int x = 0; x < n; ++x){ struct fft_complex t = a[x]; a[x] = b[x]; b[x] = t; }
+    }
+
+    float sign = inverse ? -1.0f : 1.0f;
+    for (int len = 2; len <= n; len <<= 1){
+        int half = len/2, step = n/len;
+        for (int i = 0; i < n; i += len){
+            for (int j = 0; j < half; ++j){
+                struct fft_complex w = plan->twiddle[j*step];
+                w.im *= sign;
+                struct fft_complex *a = &data[(size_t)(i+j) * n];
+                struct fft_complex *b = &data[(size_t)(i+j+half) * n];
+                for (int x = 0; x < n; ++x){
+                    float t_re = b[x].re*w.re - b[x].im*w.im;
+                    float t_im = b[x].re*w.im + b[x].im*w.re;
+                    b[x].re = a[x].re - t_re; b[x].im = a[x].im - t_im;
+                    a[x].re += t_re; a[x].im += t_im;
+                }
+            }
+        }
+    }
+}
+
+// The cost per output pixel of convolving with `k` through blocks of n x n.
+// Each pair of blocks takes a forward and an inverse transform of 2*log2(n) passes.
+static double fft_block_cost(struct kernel *k, int n){
+    int out_w = n - k->width + 1, out_h = n - k->height + 1;
+    if (out_w < 1 || out_h < 1) { return INFINITY; }
+    return (double) n * n * 2 * log2_int(n) * FFT_COST_PER_POINT / ((double) out_w * out_h);
+}
+
+// Picks the cheapest block size for `k`
+static int fft_block_size(struct kernel *k){
+    int best = 0;
+    for (int n = FFT_MIN_BLOCK; n <= FFT_MAX_BLOCK; n <<= 1){
+        if (!best || fft_block_cost(k, n) < fft_block_cost(k, best)) { best = n; }
+    }
+    return best;
+}
+
+int fft_convolve_preferred(struct kernel *k){
+    if (k->row && k->col) { return 0; }
+    if (k->width * k->height < FFT_MIN_KERNEL * FFT_MIN_KERNEL) { return 0; }
+    double direct_cost = (double) k->width * k->height * (k->ivalues ? FFT_INT_TAP_COST : 1.0);
+    return fft_block_cost(k, fft_block_size(k)) < direct_cost;
+}
+
+
+// Arguments shared by the bands of a parallel FFT convolution
+struct fft_convolve_job {
+    struct image *src;
+    struct image *dest;
+    struct kernel *k;
+    struct fft_plan *plan;
+    struct arena *arena;            // Holds the spectrum and each band's block
+    struct fft_complex *spectrum;   // The conjugated kernel spectrum, scaled by 1/(n^2 d)
+    int block_w, block_h;           // The output pixels produced by each block
+    int blocks_x;
+    enum border_mode border;
+    atomic_int failed;      // Set by any band failing to allocate
+};
+
+// Loads the source window of the block whose output starts at inner (x0, y0),
+// as the real (part = 0) or imaginary (part = 1) component of `data`.
+// Samples beyond the edges of the inner image are taken through the border mode.
+static void fft_load_block(struct fft_convolve_job *job, struct fft_complex *data,
+                           int x0, int y0, int part){
+    struct image *img = job->src;
+    int n = job->plan->n;
+    int inner_w = img->width - img->padding*2, inner_h = img->height - img->padding*2;
+    // The window's top left corner in the inner image
+    int left = x0 - job->k->width/2;
+    int top = y0 - job->k->height/2;
+
+    for (int y = 0; y < n; ++y){
+        struct fft_complex *row = &data[(size_t) y*n];
+        int src_y = border_index(top + y, inner_h, job->border);
+        unsigned char *src = src_y < 0 ? NULL : image_inner_row(img, src_y);
+        for (int x = 0; x < n; ++x){
+            int src_x = left + x;
+            if (src_x < 0 || src_x >= inner_w) { src_x = border_index(src_x, inner_w, job->border); }
+            float sample = src && src_x >= 0 ? src[src_x] : 0.0f;
+            if (part) { row[x].im = sample; }
+            else { row[x].re = sample; row[x].im = 0.0f; }
+        }
+    }
+}
+
+// Stores the valid output of a block, taken from the real (part = 0) or imaginary
+// (part = 1) component of `data`
+static void fft_store_block(struct fft_convolve_job *job, struct fft_complex *data,
+                            int x0, int y0, int part){
+    struct image *img = job->dest;
+    int n = job->plan->n;
+    int inner_w = img->width - img->padding*2, inner_h = img->height - img->padding*2;
+    int count_x = MIN(job->block_w, inner_w - x0), count_y = MIN(job->block_h, inner_h - y0);
+
+    for (int y = 0; y < count_y; ++y){
+        unsigned char *dest = image_inner_row(img, y0 + y) + x0;
+        for (int x = 0; x < count_x; ++x){
+            struct fft_complex c = data[(size_t) y*n + x];
+            float cell = roundf(part ? c.im : c.re);
+            dest[x] = (unsigned char) MIN(MAX(cell, 0.0f), 255.0f);
+        }
+    }
+}
+
+// Convolves the rows of blocks [by0, by1), two blocks per transform
+static void fft_convolve_band(void *arg, int by0, int by1){
+    struct fft_convolve_job *job = arg;
+    int n = job->plan->n;
+    struct fft_complex *data = arena_alloc(job->arena, sizeof(struct fft_complex) * n * n);
+    if (!data) { atomic_store_explicit(&job->failed, 1, memory_order_relaxed); return; }
+
+    for (int by = by0; by < by1; ++by){
+        int y0 = by * job->block_h;
+        for (int bx = 0; bx < job->blocks_x; bx += 2){
+            int x0 = bx * job->block_w, x1 = x0 + job->block_w;
+            int paired = bx + 1 < job->blocks_x;
+
+            // As the kernel is real, filtering (a + ib) yields (a * k) + i(b * k)
+            fft_load_block(job, data, x0, y0, 0);
+            if (paired) { fft_load_block(job, data, x1, y0, 1); }
+            fft_2d(job->plan, data, 0);
+            for (size_t i = 0; i < (size_t) n*n; ++i){
+                struct fft_complex a = data[i], s = job->spectrum[i];
+                data[i].re = a.re*s.re - a.im*s.im;
+                data[i].im = a.re*s.im + a.im*s.re;
+            }
+            fft_2d(job->plan, data, 1);
+            fft_store_block(job, data, x0, y0, 0);
+            if (paired) { fft_store_block(job, data, x1, y0, 1); }
+        }
+    }
+}
+
+int fft_convolve(struct image *dest, struct image *src, struct kernel *k){
+    int n = fft_block_size(k);
+    struct fft_convolve_job job = {
+        .src = src, .dest = dest, .k = k, .plan = fft_plan_get(n),
+        .block_w = n - k->width + 1, .block_h = n - k->height + 1,
+        .arena = processing_get_arena(), .border = processing_get_border(),
+    };
+    if (!job.plan || !job.arena) { return 0; }
+    atomic_init(&job.failed, 0);
+    size_t mark = arena_mark(job.arena);
+    if (!(job.spectrum = arena_alloc(job.arena, sizeof(struct fft_complex) * n * n))) { return 0; }
+    memset(job.spectrum, 0, sizeof(struct fft_complex) * n * n);
+
+    // Convolution here is a correlation, which multiplies by the conjugate spectrum.
+    // The inverse transform's scaling and the divisor are folded into the spectrum.
+    for (int y = 0; y < k->height; ++y){
+        for (int x = 0; x < k->width; ++x){ job.spectrum[(size_t) y*n + x].re = k->values[y][x]; }
+    }
+    fft_2d(job.plan, job.spectrum, 0);
+    float scale = 1.0f / ((float) n * n * k->divisor);
+    for (size_t i = 0; i < (size_t) n*n; ++i){
+        job.spectrum[i].re *= scale;
+        job.spectrum[i].im *= -scale;
+    }
+
+    int inner_w = src->width - src->padding*2, inner_h = src->height - src->padding*2;
+    job.blocks_x = (inner_w + job.block_w - 1) / job.block_w;
+    threadpool_run_bands(0, (inner_h + job.block_h - 1) / job.block_h,
+                         fft_convolve_band, &job);
+
+    arena_reset(job.arena, mark);
+    return !atomic_load(&job.failed);
+}
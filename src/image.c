@@ -1,125 +1,161 @@
 #include "../include/image.h"
+#include "../include/memstats.h"
+#include "../include/threadpool.h"
+
+// stb_image's buffers are accounted for along with the rest
+#define STBI_MALLOC(sz) mem_malloc(sz)
+#define STBI_REALLOC(p, newsz) mem_realloc(p, newsz)
+#define STBI_FREE(p) mem_free(p)
+#define STBIW_MALLOC(sz) mem_malloc(sz)
+#define STBIW_REALLOC(p, newsz) mem_realloc(p, newsz)
+#define STBIW_FREE(p) mem_free(p)
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "../include/stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "../include/stb_image_write.h"
 
-void image_free(struct image *img){ free(img->data); free(img); }
+void image_free(struct image *img){ 
+    // Views share their parent's data
+    if (!img->parent) { mem_free(img->data); }
+    mem_free(img); 
+}
+
+// Allocates an image owning an (uninitialized) aligned buffer, with rows IMAGE_ALIGN apart
+static struct image *image_alloc(int width, int height, int channels, int padding){
+    struct image *img = mem_malloc(sizeof(struct image));
+    if (!img) { return 0; }
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->padding = padding;
+    img->offset = 0;
+    img->stride = image_stride(width, channels);
+    img->parent = NULL;
+
+    if (!(img->data = mem_aligned_alloc(IMAGE_ALIGN, MAX(img->stride * height, IMAGE_ALIGN)))){
+        mem_free(img);
+        return 0;
+    }
+    return img;
+}
 
 struct image *image_load(const char *path){
-    struct image *img = malloc(sizeof(struct image));
-    if (!img) { return NULL; }
+    int width, height, channels;
+    unsigned char *pixels = stbi_load(path, &width, &height, &channels, 0);
+    if (!pixels) { return NULL; }
     
-    if (!(img->data=stbi_load(path, &img->width, &img->height, &img->channels, 0))){
-        return NULL;
+    // stb_image decodes into tightly packed rows, which are copied into aligned ones
+    struct image *img = image_alloc(width, height, channels, 0);
+    if (img){
+        size_t row_size = (size_t) width * channels;
+        for (int y = 0; y < height; ++y){
+            memcpy(image_row(img, y), &pixels[y * row_size], row_size);
+        }
     }
-    
-    img->padding = 0;
+    stbi_image_free(pixels);
     return img;
 }
 
 
 int image_write_to_disk(struct image *img, const char *path) {
     return stbi_write_png(path,
-            img->width, img->height, img->channels, img->data,
-            img->width * img->channels);
+            img->width, img->height, img->channels, image_row(img, 0),
+            (int) img->stride);
 }
 
 
 struct image *image_to_1channel(struct image *img){
-    // TODO allow conversion of padded images
-    if (img->padding) { return 0; }
-
     // Allocate space for the new one channel image
-    struct image *img_out = malloc(sizeof(struct image));
+    struct image *img_out = image_alloc(img->width, img->height, 1, img->padding);
     if (!img_out) { return 0; }
-    img_out->data = malloc(img->width * img->height);
-    if (!img_out->data) { return 0; }
-    
-    img_out->width = img->width;
-    img_out->height = img->height;
-    img_out->channels = 1;
-    img_out->padding = 0;
-
-    size_t img_size = (size_t) (img->width * img->height * img ->channels);
-    for (size_t i = 0; i < img_size; i+=img->channels){
-        img_out->data[i/img->channels] = img->data[i];
+
+    for (int y = 0; y < img->height; ++y){
+        unsigned char *src = image_row(img, y), *dest = image_row(img_out, y);
+        for (int x = 0; x < img->width; ++x){ dest[x] = src[x * img->channels]; }
     }
 
     return img_out;
 }
 
 struct image *image_clone(struct image *img){
-    struct image *new_img = malloc(sizeof(struct image));
+    // Clones of views own a copy of only the viewed pixels
+    struct image *new_img = image_alloc(img->width, img->height, img->channels, img->padding);
     if (!new_img) { return 0; }
-    new_img->width = img->width;
-    new_img->height = img->height;
-    new_img->channels = img->channels;
-    new_img->padding = img->padding;
-    new_img->data = malloc(img->width * img->height);
-    if (!new_img->data) { return 0; }
-    memcpy(new_img->data, img->data, img->width*img->height*img->channels);
+    size_t row_size = (size_t) img->width * img->channels;
+    for (int y = 0; y < img->height; ++y){
+        memcpy(image_row(new_img, y), image_row(img, y), row_size);
+    }
 
     return new_img;
 }
 
+struct image *image_create(int width, int height, int channels, int padding){
+    struct image *img = image_alloc(width, height, channels, padding);
+    if (!img) { return 0; }
+    memset(img->data, 0, img->stride * height);
+
+    return img;
+}
+
+int image_view(struct image *view, struct image *img, int x, int y, int width, int height){
+    if (x < 0 || y < 0 || width < 0 || height < 0 || 
+        x + width > img->width || y + height > img->height) { return 0; }
+
+    *view = *img;
+    view->width = width;
+    view->height = height;
+    view->padding = 0;
+    view->offset = img->offset + (size_t) y * img->stride + (size_t) x * img->channels;
+    // Views of views share the data of the image that owns it
+    view->parent = img->parent ? img->parent : img;
+    return 1;
+}
+
 struct image *image_pad(struct image *img, int amount){
     // Sanity checking
     if (img->channels != 1) { return 0; }
     if (amount <= 0) { return 0; }
     
+    // Views with room around them in their parent are padded by widening the view
+    struct image *parent = img->parent;
+    if (parent){
+        struct image *padded = mem_malloc(sizeof(struct image));
+        if (!padded) { return 0; }
+        size_t origin = img->offset - parent->offset;
+        int x = (int)(origin % img->stride) / img->channels, y = (int)(origin / img->stride);
+        if (image_view(padded, parent, x - amount, y - amount, 
+                       img->width + amount*2, img->height + amount*2)){
+            padded->padding = img->padding + amount;
+            return padded;
+        }
+        mem_free(padded);
+    }
+
     // Allocated space for newly padded image
-    struct image *padded = malloc(sizeof(struct image));
+    struct image *padded = image_create(img->width + amount*2, img->height + amount*2, 
+                                        img->channels, img->padding + amount);
     if (!padded) { return 0; }
-
-    padded->width = img->width+amount*2;
-    padded->height = img->height+amount*2;
-    padded->channels = img->channels;
-    padded->padding = img->padding + amount;
-
-    padded->data = calloc(padded->width * padded->height, 1);
-    if (!padded->data) { return 0; }
     
     for (int y = 0; y < img->height; ++y){
-        for (int x = 0; x < img->width; ++x) {
-            int src_i = x + y * img->width;
-            int dest_i = amount+x + (amount+y)*padded->width;
-            padded->data[dest_i] = img->data[src_i];
-        }
+        memcpy(image_row(padded, amount + y) + amount, image_row(img, y), img->width);
     }
 
     return padded;
 }
 
 struct image *image_unpad(struct image *img, int amount){
-    //TODO make this a superset of unpad into to deduplicate.
-
     // Sanity checking
     if (img->padding < amount) { return 0;}
     if (img->channels != 1) { return 0; }
     if (amount <= 0) { return 0; }
     
-    // Allocated space for newly padded image
-    struct image *unpadded = malloc(sizeof(struct image));
+    // The unpadded image is a view of img's data
+    struct image *unpadded = mem_malloc(sizeof(struct image));
     if (!unpadded) { return 0; }
 
-    unpadded->width = img->width-amount*2;
-    unpadded->height = img->height-amount*2;
-    unpadded->channels = img->channels;
+    image_view(unpadded, img, amount, amount, img->width - amount*2, img->height - amount*2);
     unpadded->padding = img->padding - amount;
-
-    unpadded->data = malloc(unpadded->width * unpadded->height);
-    if (!unpadded->data) { return 0; }
-    
-    for (int y = 0; y < unpadded->height; ++y){
-        for (int x = 0; x < unpadded->width; ++x) {
-            int dest_i = x + y * unpadded->width;
-            int src_i = amount+x + (amount+y)*img->width;
-            unpadded->data[dest_i] = img->data[src_i];
-        }
-    }
-
     return unpadded;
 }
 
@@ -136,32 +172,51 @@ int image_unpad_into(struct image *dest, struct image *src){
     int amount = amt_x/2;
 
     for (int y = 0; y < dest->height; ++y){
-        for (int x = 0; x < dest->width; ++x) {
-            int dest_i = x + y * dest->width;
-            int src_i = amount+x + (amount+y) * src->width;
-            dest->data[dest_i] = src->data[src_i];
-        }
+        memcpy(image_row(dest, y), image_row(src, amount + y) + amount, dest->width);
     }
 
     return 1;
 }
 
 
+// The images merged by image_merge_add_into()
+struct merge_job {
+    struct image *dest;
+    struct image *img_a;
+    struct image *img_b;
+};
+
+// Merges the rows [y0, y1) of img_a and img_b into dest
+static void merge_add_band(void *arg, int y0, int y1){
+    struct merge_job *job = arg;
+    size_t row_size = (size_t) job->img_a->width * job->img_a->channels;
+    for (int y = y0; y < y1; ++y){
+        unsigned char *row_a = image_row(job->img_a, y), *row_b = image_row(job->img_b, y);
+        unsigned char *dest = image_row(job->dest, y);
+        for (size_t i = 0; i < row_size; ++i){
+            unsigned int a = (unsigned int) row_a[i];
+            unsigned int b = (unsigned int) row_b[i];
+            dest[i] = MIN(a + b, 255);
+        }
+    }
+}
+
 int image_merge_add(struct image *img_a, struct image *img_b){
+    return image_merge_add_into(img_a, img_a, img_b);
+}
+
+int image_merge_add_into(struct image *dest, struct image *img_a, struct image *img_b){
     // Ensure images are compatible for merging
-    if (img_a->width != img_b->width ||
-        img_a->height != img_b->height ||
-        img_a->channels != img_b->channels ||
-        img_a->padding != img_b->padding) {
+    if (img_a->width != img_b->width || dest->width != img_a->width ||
+        img_a->height != img_b->height || dest->height != img_a->height ||
+        img_a->channels != img_b->channels || dest->channels != img_a->channels ||
+        img_a->padding != img_b->padding || dest->padding != img_a->padding) {
         fprintf(stderr, "%s\tImage dimension mismatch. \n\t\tAborting merge.\n", WARN_TXT);
         return 0;
     }
     
     // Add bytes between two images, clamping to 255
-    for (int i = 0; i < img_a->height * img_a->width; ++i){
-        unsigned int a = (unsigned int) img_a->data[i];
-        unsigned int b = (unsigned int) img_b->data[i];
-        img_a->data[i] = MIN(a + b, 255);
-    }
+    struct merge_job job = { .dest = dest, .img_a = img_a, .img_b = img_b };
+    threadpool_run_bands(0, img_a->height, merge_add_band, &job);
     return 1;
 }
@@ -0,0 +1,207 @@
+#include "../include/memstats.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every allocation is preceded by a header recording its size and the stage it belongs to.
+// It takes as much room as max_align_t, keeping malloc's alignment for the memory after it.
+struct mem_header {
+    size_t size;
+    int stage;              // Its index in stats.stage, -1 outside of any stage
+    unsigned int offset;    // The distance from the start of the allocation to the memory
+};
+#define HEADER_SIZE (alignof(max_align_t) > sizeof(struct mem_header) ? \
+                     alignof(max_align_t) : sizeof(struct mem_header))
+
+static struct {
+    pthread_mutex_t lock;
+    struct mem_stats stats;
+    int stack[MEM_STATS_MAX_STAGES];    // The indices of the stages pushed
+    int depth;
+    int overflow;                       // Pushes beyond the stack, each undone by a pop
+} mem = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static inline struct mem_header *mem_header_of(void *ptr){
+    return (struct mem_header *)((unsigned char *) ptr - HEADER_SIZE);
+}
+
+// Raises the peaks of every stage running to what is held now
+static void mem_stats_raise_peaks(void){
+    struct mem_stats *stats = &mem.stats;
+    for (int i = 0; i < mem.depth; ++i){
+        if (mem.stack[i] < 0) { continue; }
+        struct mem_stage *stage = &stats->stage[mem.stack[i]];
+        stage->peak = MAX(stage->peak, stats->current);
+        stage->arena_peak = MAX(stage->arena_peak, stats->arena_current);
+    }
+}
+
+// Fills in the header of a new allocation and accounts for it
+static void *mem_record(unsigned char *base, unsigned int offset, size_t size){
+    struct mem_header *header = (struct mem_header *)(base + offset - HEADER_SIZE);
+    header->size = size;
+    header->offset = offset;
+
+    pthread_mutex_lock(&mem.lock);
+    struct mem_stats *stats = &mem.stats;
+    header->stage = mem.depth ? mem.stack[mem.depth-1] : -1;
+    stats->allocs++;
+    stats->bytes += size;
+    stats->current += size;
+    stats->peak = MAX(stats->peak, stats->current);
+    if (header->stage >= 0){
+        struct mem_stage *stage = &stats->stage[header->stage];
+        stage->allocs++;
+        stage->bytes += size;
+        stage->current += size;
+    }
+    mem_stats_raise_peaks();
+    pthread_mutex_unlock(&mem.lock);
+    return base + offset;
+}
+
+// Accounts for the release of an allocation
+static void mem_unrecord(struct mem_header header){
+    pthread_mutex_lock(&mem.lock);
+    mem.stats.frees++;
+    mem.stats.current -= header.size;
+    if (header.stage >= 0) { mem.stats.stage[header.stage].current -= header.size; }
+    pthread_mutex_unlock(&mem.lock);
+}
+
+void *mem_malloc(size_t size){
+    if (size > SIZE_MAX - HEADER_SIZE) { return NULL; }
+    unsigned char *base = malloc(HEADER_SIZE + size);
+    return base ? mem_record(base, HEADER_SIZE, size) : NULL;
+}
+
+void *mem_aligned_alloc(size_t alignment, size_t size){
+    // The header takes a whole alignment ahead of the memory, which keeps it aligned
+    size_t offset = MAX(alignment, HEADER_SIZE);
+    if (size > SIZE_MAX - offset*2) { return NULL; }
+    // aligned_alloc() requires a size that is a multiple of the alignment
+    size_t total = (offset + size + alignment - 1) / alignment * alignment;
+    unsigned char *base = aligned_alloc(alignment, total);
+    return base ? mem_record(base, (unsigned int) offset, size) : NULL;
+}
+
+void *mem_realloc(void *ptr, size_t size){
+    if (!ptr) { return mem_malloc(size); }
+    if (size > SIZE_MAX - HEADER_SIZE) { return NULL; }
+
+    // The header is kept aside, as realloc() may free the old block. On failure it is
+    // left untouched, and still accounted for.
+    struct mem_header old = *mem_header_of(ptr);
+    unsigned char *base = realloc((unsigned char *) ptr - HEADER_SIZE, HEADER_SIZE + size);
+    if (!base) { return NULL; }
+    mem_unrecord(old);
+    return mem_record(base, HEADER_SIZE, size);
+}
+
+void mem_free(void *ptr){
+    if (!ptr) { return; }
+    struct mem_header header = *mem_header_of(ptr);
+    mem_unrecord(header);
+    free((unsigned char *) ptr - header.offset);
+}
+
+void mem_stats_arena_alloc(size_t bytes){
+    pthread_mutex_lock(&mem.lock);
+    struct mem_stats *stats = &mem.stats;
+    int stage = mem.depth ? mem.stack[mem.depth-1] : -1;
+    stats->arena += bytes;
+    stats->arena_current += bytes;
+    stats->arena_peak = MAX(stats->arena_peak, stats->arena_current);
+    if (stage >= 0) { stats->stage[stage].arena += bytes; }
+    mem_stats_raise_peaks();
+    pthread_mutex_unlock(&mem.lock);
+}
+
+void mem_stats_arena_release(size_t bytes){
+    pthread_mutex_lock(&mem.lock);
+    mem.stats.arena_current -= MIN(bytes, mem.stats.arena_current);
+    pthread_mutex_unlock(&mem.lock);
+}
+
+
+void mem_stats_push(const char *name){
+    pthread_mutex_lock(&mem.lock);
+    // Stages nested too deep are accounted to the deepest one on the stack
+    if (mem.depth == MEM_STATS_MAX_STAGES){
+        mem.overflow++;
+        pthread_mutex_unlock(&mem.lock);
+        return;
+    }
+
+    struct mem_stats *stats = &mem.stats;
+    int index = -1;
+    for (int i = 0; i < stats->stages; ++i){
+        if (!strcmp(stats->stage[i].name, name)) { index = i; break; }
+    }
+    if (index < 0 && stats->stages < MEM_STATS_MAX_STAGES){
+        index = stats->stages++;
+        stats->stage[index] = (struct mem_stage) { .name = name, .depth = mem.depth };
+    }
+    // Without room for it, the stage is accounted to the one it is nested in
+    if (index < 0) { index = mem.depth ? mem.stack[mem.depth-1] : -1; }
+
+    mem.stack[mem.depth++] = index;
+    if (index >= 0){
+        struct mem_stage *stage = &stats->stage[index];
+        stage->peak = MAX(stage->peak, stats->current);
+        stage->arena_peak = MAX(stage->arena_peak, stats->arena_current);
+    }
+    pthread_mutex_unlock(&mem.lock);
+}
+
+void mem_stats_pop(void){
+    pthread_mutex_lock(&mem.lock);
+    // A push that overflowed the stack is undone before any stage on it
+    if (mem.overflow) { mem.overflow--; }
+    else if (mem.depth) { mem.depth--; }
+    pthread_mutex_unlock(&mem.lock);
+}
+
+void mem_stats_get(struct mem_stats *stats){
+    pthread_mutex_lock(&mem.lock);
+    *stats = mem.stats;
+    pthread_mutex_unlock(&mem.lock);
+}
+
+// Formats a size in bytes with a binary unit
+static const char *mem_format_size(char buf[16], size_t size){
+    static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double value = (double) size;
+    int unit = 0;
+    while (value >= 1024.0 && unit < (int)(sizeof(units)/sizeof(*units)) - 1){
+        value /= 1024.0;
+        unit++;
+    }
+    if (unit) { snprintf(buf, 16, "%.1f %s", value, units[unit]); }
+    else { snprintf(buf, 16, "%zu B", size); }
+    return buf;
+}
+
+void mem_stats_print(FILE *stream){
+    struct mem_stats stats;
+    mem_stats_get(&stats);
+    char bytes[16], current[16], peak[16], arena[16], arena_peak[16];
+
+    // The heap columns, then those of the arenas
+    fprintf(stream, "%s\tMemory use:\n\t\t%-24s %8s %12s %12s %12s %12s %12s\n", INFO_TXT,
+            "stage", "allocs", "allocated", "held", "peak", "arena", "arena peak");
+    for (int i = 0; i < stats.stages; ++i){
+        struct mem_stage *stage = &stats.stage[i];
+        fprintf(stream, "\t\t%*s%-*s %8zu %12s %12s %12s %12s %12s\n",
+                stage->depth*2, "", 24 - stage->depth*2, stage->name, stage->allocs,
+                mem_format_size(bytes, stage->bytes), mem_format_size(current, stage->current),
+                mem_format_size(peak, stage->peak), mem_format_size(arena, stage->arena),
+                mem_format_size(arena_peak, stage->arena_peak));
+    }
+    fprintf(stream, "\t\t%-24s %8zu %12s %12s %12s %12s %12s\n", "total", stats.allocs,
+            mem_format_size(bytes, stats.bytes), mem_format_size(current, stats.current),
+            mem_format_size(peak, stats.peak), mem_format_size(arena, stats.arena),
+            mem_format_size(arena_peak, stats.arena_peak));
+}
@@ -1,136 +1,820 @@
 #include "../include/processing.h"
+#include "../include/fft.h"
+#include "../include/memstats.h"
+#include "../include/simd.h"
+#include "../include/threadpool.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// Applies the divisor to a summed cell, then rounds and clamps it to a byte
+static inline unsigned char kernel_float_result(float cell, float divisor){
+    // Apply the divisor after all summing is complete
+    cell /= divisor;
+    // Clamp the cell's result to a byte
+    cell = roundf(cell);
+    if (cell > 255.0) { cell = 255.0; }
+    else if (cell < 0.0) { cell = 0.0; }
+    return (unsigned char) cell;
+}
+
+// Divides, rounds and clamps the sum of an integer kernel exactly as the float path would.
+// For positive sums round(sum/d) == floor((2*sum + d) / 2d), which is clamped below 256
+// so that it can be divided through the kernel's reciprocal multiplier.
+static inline unsigned char kernel_int_result(struct kernel *k, int sum){
+    if (sum <= 0) { return 0; }
+    unsigned int n = 2u * (unsigned int) sum + (unsigned int) k->idivisor;
+    n = MIN(n, 512u * (unsigned int) k->idivisor - 1);
+    if (k->div_mul) { return (unsigned char)((n * k->div_mul) >> KERNEL_DIV_SHIFT); }
+    return (unsigned char)(n / (2u * (unsigned int) k->idivisor));
+}
+
+/*
+ * Row convolution routines.
+ *
+ * Each convolves `count` pixels of a row, where `rows` holds each source row covered by
+ * the kernel pointing at the left most tap of the first pixel. The generic routines
+ * handle any kernel, while the DEFINE_* macros generate copies for the fixed kernel sizes
+ * used by the filters. With constant bounds the compiler fully unrolls the taps and keeps
+ * the coefficients in registers. All variants sum in the same order, so they are
+ * interchangeable.
+ */
+typedef void (*convolve_row_fn)(unsigned char *dest, unsigned char **rows, 
+                                struct kernel *k, int count);
+
+static void convolve_row_float(unsigned char *dest, unsigned char **rows, 
+                               struct kernel *k, int count){
+    for (int x = 0; x < count; ++x){
+        // Create a value to store the result of the selected cell
+        float cell = 0.0;
+
+        // Apply each value from the kernel to the respective offset in the image
+        for (int ky = 0; ky < k->height; ++ky){
+            for (int kx = 0; kx < k->width; ++kx){
+                // Sum the product of the kernel and the offset cell
+                cell += k->values[ky][kx] * (float)(rows[ky][x+kx]);
+            }
+        }
+        dest[x] = kernel_float_result(cell, k->divisor);
+    }
+}
+
+static void convolve_row_int(unsigned char *dest, unsigned char **rows, 
+                             struct kernel *k, int count){
+    for (int x = 0; x < count; ++x){
+        int sum = 0;
+        int *val = k->ivalues;
+        for (int ky = 0; ky < k->height; ++ky){
+            for (int kx = 0; kx < k->width; ++kx){
+                sum += *val++ * (int)(rows[ky][x+kx]);
+            }
+        }
+        dest[x] = kernel_int_result(k, sum);
+    }
+}
+
+#define DEFINE_CONVOLVE_ROW(KH, KW) \
+static void convolve_row_float_##KH##x##KW(unsigned char *dest, unsigned char **rows, \
+                                           struct kernel *k, int count){ \
+    float vals[KH][KW]; \
+    unsigned char *src[KH]; \
+    for (int ky = 0; ky < KH; ++ky){ \
+        src[ky] = rows[ky]; \
+        for (int kx = 0; kx < KW; ++kx){ vals[ky][kx] = k->values[ky][kx]; } \
+    } \
+    for (int x = 0; x < count; ++x){ \
+        float cell = 0.0; \
+        for (int ky = 0; ky < KH; ++ky){ \
+            for (int kx = 0; kx < KW; ++kx){ \
+                cell += vals[ky][kx] * (float)(src[ky][x+kx]); \
+            } \
+        } \
+        dest[x] = kernel_float_result(cell, k->divisor); \
+    } \
+} \
+static void convolve_row_int_##KH##x##KW(unsigned char *dest, unsigned char **rows, \
+                                         struct kernel *k, int count){ \
+    int vals[KH][KW]; \
+    unsigned char *src[KH]; \
+    for (int ky = 0; ky < KH; ++ky){ \
+        src[ky] = rows[ky]; \
+        for (int kx = 0; kx < KW; ++kx){ vals[ky][kx] = k->ivalues[ky*KW + kx]; } \
+    } \
+    for (int x = 0; x < count; ++x){ \
+        int sum = 0; \
+        for (int ky = 0; ky < KH; ++ky){ \
+            for (int kx = 0; kx < KW; ++kx){ \
+                sum += vals[ky][kx] * (int)(src[ky][x+kx]); \
+            } \
+        } \
+        dest[x] = kernel_int_result(k, sum); \
+    } \
+}
+
+// Roberts Cross
+DEFINE_CONVOLVE_ROW(2, 2)
+// Sobel, Scharr and Laplacian
+DEFINE_CONVOLVE_ROW(3, 3)
+
+// Picks the row routine for a (non-separable) kernel by its shape
+static convolve_row_fn convolve_row_select(struct kernel *k){
+    if (k->width == 2 && k->height == 2){
+        return k->ivalues ? convolve_row_int_2x2 : convolve_row_float_2x2;
+    }
+    if (k->width == 3 && k->height == 3){
+        return k->ivalues ? convolve_row_int_3x3 : convolve_row_float_3x3;
+    }
+    return k->ivalues ? convolve_row_int : convolve_row_float;
+}
+
+/*
+ * 1D pass routines for separable kernels, generic and generated as above.
+ *
+ * The horizontal pass filters `count` bytes of `src` (pointing at the left tap of the first
+ * pixel) into floats using k->row. The vertical pass combines `rows` (one per tap of k->col)
+ * into `count` output bytes.
+ */
+typedef void (*convolve_hpass_fn)(float *dest, unsigned char *src, struct kernel *k, int count);
+typedef void (*convolve_vpass_fn)(unsigned char *dest, float **rows, struct kernel *k, int count);
+
+static void convolve_hpass(float *dest, unsigned char *src, struct kernel *k, int count){
+    for (int x = 0; x < count; ++x){
+        float cell = 0.0;
+        for (int kx = 0; kx < k->width; ++kx){
+            cell += k->row[kx] * (float)(src[x+kx]);
+        }
+        dest[x] = cell;
+    }
+}
+
+static void convolve_vpass(unsigned char *dest, float **rows, struct kernel *k, int count){
+    for (int x = 0; x < count; ++x){
+        float cell = 0.0;
+        for (int ky = 0; ky < k->height; ++ky){
+            cell += k->col[ky] * rows[ky][x];
+        }
+        dest[x] = kernel_float_result(cell, k->divisor);
+    }
+}
+
+#define DEFINE_CONVOLVE_PASSES(N) \
+static void convolve_hpass_##N(float *dest, unsigned char *src, struct kernel *k, int count){ \
+    float taps[N]; \
+    for (int kx = 0; kx < N; ++kx){ taps[kx] = k->row[kx]; } \
+    for (int x = 0; x < count; ++x){ \
+        float cell = 0.0; \
+        for (int kx = 0; kx < N; ++kx){ cell += taps[kx] * (float)(src[x+kx]); } \
+        dest[x] = cell; \
+    } \
+} \
+static void convolve_vpass_##N(unsigned char *dest, float **rows, struct kernel *k, int count){ \
+    float taps[N]; \
+    float *src[N]; \
+    for (int ky = 0; ky < N; ++ky){ taps[ky] = k->col[ky]; src[ky] = rows[ky]; } \
+    for (int x = 0; x < count; ++x){ \
+        float cell = 0.0; \
+        for (int ky = 0; ky < N; ++ky){ cell += taps[ky] * src[ky][x]; } \
+        dest[x] = kernel_float_result(cell, k->divisor); \
+    } \
+}
+
+// Gaussian blur, as used by filter_canny/filter_LoG and filter_gaussian
+DEFINE_CONVOLVE_PASSES(5)
+DEFINE_CONVOLVE_PASSES(7)
+
+// The tile size set through processing_set_tile_size(), 0 when derived from the cache
+static int tile_width_override = 0;
+static int tile_height_override = 0;
+
+// The border mode set through processing_set_border()
+static enum border_mode border_mode = BORDER_CONSTANT;
+
+// The gradient magnitude set through processing_set_gradient_norm()
+static enum gradient_norm gradient_norm = GRADIENT_L1;
+
+// The scratch memory budget set through processing_set_max_memory(), 0 for none
+static size_t max_memory = 0;
+
+// The hysteresis algorithm set through processing_set_hysteresis()
+static enum hysteresis_mode hysteresis_mode = HYSTERESIS_FLOOD;
+
+void processing_set_tile_size(int width, int height){
+    tile_width_override = MAX(width, 0);
+    tile_height_override = MAX(height, 0);
+}
+
+void processing_set_border(enum border_mode mode){ border_mode = mode; }
+
+enum border_mode processing_get_border(void){ return border_mode; }
+
+void processing_set_gradient_norm(enum gradient_norm norm){ gradient_norm = norm; }
+
+enum gradient_norm processing_get_gradient_norm(void){ return gradient_norm; }
+
+void processing_set_max_memory(size_t bytes){ max_memory = bytes; }
+
+size_t processing_get_max_memory(void){ return max_memory; }
+
+void processing_set_hysteresis(enum hysteresis_mode mode){ hysteresis_mode = mode; }
+
+enum hysteresis_mode processing_get_hysteresis(void){ return hysteresis_mode; }
+
+int border_index(int i, int n, enum border_mode mode){
+    if (i >= 0 && i < n) { return i; }
+    switch (mode){
+        case BORDER_REPLICATE: 
+            return i < 0 ? 0 : n - 1;
+        case BORDER_REFLECT:
+            // Reflections repeat with a period of 2n
+            i %= 2*n;
+            if (i < 0) { i += 2*n; }
+            return i < n ? i : 2*n - 1 - i;
+        case BORDER_WRAP:
+            i %= n;
+            return i < 0 ? i + n : i;
+        default: 
+            return -1;
+    }
+}
+
+// The arena set through processing_set_arena(), and the one used when none is set
+static struct arena *scratch_arena = NULL;
+static struct arena *default_arena = NULL;
+
+static void default_arena_free(void){ arena_free(default_arena); }
+
+void processing_set_arena(struct arena *arena){ scratch_arena = arena; }
 
-// A gloriously inefficient way to test if an index is not in the padding of an image
-int inner_image_contains(struct image *img, size_t i){
-    size_t w = (size_t)(img->width);  
-    size_t p = (size_t)(img->padding);
+struct arena *processing_get_arena(void){
+    if (scratch_arena) { return scratch_arena; }
+    if (!default_arena && (default_arena = arena_create(PROCESSING_ARENA_SIZE))){
+        atexit(default_arena_free);
+    }
+    return default_arena;
+}
+
+// Allocates scratch memory, released once the arena is reset to an earlier mark
+static void *scratch_alloc(size_t size){
+    struct arena *arena = processing_get_arena();
+    return arena ? arena_alloc(arena, size) : NULL;
+}
+
+static size_t scratch_mark(void){
+    struct arena *arena = processing_get_arena();
+    return arena ? arena_mark(arena) : 0;
+}
+
+static void scratch_reset(size_t mark){
+    struct arena *arena = processing_get_arena();
+    if (arena) { arena_reset(arena, mark); }
+}
+
+// Allocates an intermediate image shaped like `like` in the scratch arena. Only its padding
+// is cleared (to black), as the inner image is always written before it is read.
+static struct image *scratch_image(struct image *like){
+    struct image *img = scratch_alloc(sizeof(struct image));
+    unsigned char *data = scratch_alloc(image_stride(like->width, like->channels) * like->height);
+    if (!img || !data) { return NULL; }
+    *img = (struct image) { 
+        .width = like->width, .height = like->height, 
+        .channels = like->channels, .padding = like->padding, .data = data,
+        .stride = image_stride(like->width, like->channels),
+    };
+
+    size_t row_size = (size_t) img->width * img->channels;
+    size_t pad_size = (size_t) img->padding * img->channels;
+    for (int y = 0; y < img->height && img->padding; ++y){
+        unsigned char *row = image_row(img, y);
+        if (y < img->padding || y >= img->height - img->padding){ memset(row, 0, row_size); }
+        else {
+            memset(row, 0, pad_size);
+            memset(&row[row_size - pad_size], 0, pad_size);
+        }
+    }
+    return img;
+}
+
+/*
+ * Strip processing, for filters running under a memory budget.
+ *
+ * The image is processed in horizontal strips of whole rows, each copied into a scratch
+ * image along with up to `halo` rows either side of it. A pipeline then runs on the copy
+ * just as it would on the whole image, and only the rows of the strip itself are copied
+ * back. The pipeline's results are off near the edges of the copy that cut through the
+ * image, but as long as the halo covers every row the pipeline reads, they are off within
+ * the halo alone. Copies end at the edges of the image, so that each stage meets them
+ * (and applies the border mode) exactly as it would on the whole image.
+ *
+ * Results are written back in place, so the original rows that the next strip's halo 
+ * reaches above it are kept aside beforehand.
+ */
+
+// Runs a pipeline on a strip copy, returning the image holding the result: either `strip`
+// or `buf`, a scratch image of the same size. The rows [y0, y1) of the copy are those of
+// the strip itself, the rest its halo. Returns NULL on failure.
+typedef struct image *(*strip_fn)(struct image *strip, struct image *buf, int y0, int y1, 
+                                  void *ctx);
+
+// Returns the rows per strip that keep a pipeline within the memory budget, or 0 if it
+// should run on the whole image. `row_cost` is the scratch memory the pipeline needs per
+// row of a strip (including the strip and buf images), `image_cost` per row of the image,
+// and `extra` what it needs besides, whatever the height.
+static int strip_rows(struct image *img, int halo, size_t row_cost, size_t image_cost,
+                      size_t extra){
+    int inner_w = img->width - img->padding*2, inner_h = img->height - img->padding*2;
+    if (!max_memory || (size_t) inner_h * image_cost + extra <= max_memory) { return 0; }
+    // Strips gain nothing on images barely taller than their halos
+    if (inner_h <= halo*4) { return 0; }
+    // A wrapping border joins the top and bottom of every intermediate image
+    if (border_mode == BORDER_WRAP){
+        fprintf(stderr, "%s\tStrips cannot wrap around the image.\n"
+                "\t\tIgnoring the memory budget.\n", WARN_TXT);
+        return 0;
+    }
+
+    // The rows kept aside, and the halos of the strip
+    size_t fixed = (size_t) halo * (image_stride(inner_w, 1) + row_cost*2) + extra;
+    long rows = max_memory > fixed ? (long)((max_memory - fixed) / row_cost) : 0;
+    if (rows < 1){
+        fprintf(stderr, "%s\tMemory budget too small for strips %d pixels wide.\n"
+                "\t\tExceeding it.\n", WARN_TXT, inner_w);
+        rows = 1;
+    }
+    return rows >= inner_h ? 0 : (int) rows;
+}
+
+// Applies fn to the inner image of img in strips of `rows` rows, each with up to `halo`
+// rows either side
+static int strip_apply(struct image *img, int rows, int halo, strip_fn fn, void *ctx){
+    int inner_w = img->width - img->padding*2, inner_h = img->height - img->padding*2;
+    size_t stride = image_stride(inner_w, 1);
+    size_t mark = scratch_mark();
+    struct image shape = { .width = inner_w, .height = rows + halo*2, .channels = 1 };
+    struct image *strip = scratch_image(&shape), *buf = scratch_image(&shape);
+    unsigned char *carry = scratch_alloc(stride * halo);
+    if (!strip || !buf || !carry){
+        fprintf(stderr, "\n%s\tFailed to allocate strips. \n\t\tAborting.\n", WARN_TXT);
+        scratch_reset(mark);
+        return 0;
+    }
+
+    int success = 1;
+    for (int y0 = 0; y0 < inner_h && success; y0 += rows){
+        int y1 = MIN(y0 + rows, inner_h);
+        int top = MAX(y0 - halo, 0), bottom = MIN(y1 + halo, inner_h);
+        strip->height = buf->height = bottom - top;
+
+        // Rows above the strip have been written, their originals being kept aside
+        for (int y = top; y < bottom; ++y){
+            unsigned char *src = y >= y0 ? image_inner_row(img, y) 
+                                         : &carry[(size_t)(y - (y0 - halo)) * stride];
+            memcpy(image_row(strip, y - top), src, inner_w);
+        }
+        for (int y = MAX(y1 - halo, top); y < y1; ++y){
+            memcpy(&carry[(size_t)(y - (y1 - halo)) * stride], image_row(strip, y - top), inner_w);
+        }
+
+        struct image *result = fn(strip, buf, y0 - top, y1 - top, ctx);
+        if (!result) { success = 0; break; }
+        for (int y = y0; y < y1; ++y){
+            memcpy(image_inner_row(img, y), image_row(result, y - top), inner_w);
+        }
+    }
+
+    scratch_reset(mark);
+    return success;
+}
+
+// Returns the size of the (per core) L2 cache in bytes
+static size_t cache_l2_size(void){
+    static size_t size = 0;
+    if (!size){
+        long detected = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+        detected = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        // Fall back on a conservative size if the cache cannot be detected
+        size = detected > 0 ? (size_t) detected : 256 * 1024;
+    }
+    return size;
+}
 
-    size_t inner_w = (size_t)(img->width - img->padding*2);
-    size_t inner_h = (size_t)(img->height - img->padding*2);
+// Chooses the tile size for convolving with `k`, aiming to keep the source rows under the
+// kernel (and the ring buffer of separable kernels) within half of the L2 cache
+static void convolve_tile_size(struct kernel *k, int *tile_w, int *tile_h){
+    size_t budget = cache_l2_size() / 2;
+    size_t px_bytes = (size_t) k->height * (k->row ? 1 + sizeof(float) : 1);
 
-    size_t x = i%w, y = i/w;
-    size_t tl = w*p + p;
-    size_t tl_x = tl%w, tl_y = tl/w;
+    // Tile widths are kept a multiple of 64, so tiles of unpadded images start on a cache line
+    *tile_w = tile_width_override;
+    if (!*tile_w) { *tile_w = MAX((int)(budget / px_bytes) / 64 * 64, 64); }
     
-    return (tl_x <= x && tl_x+inner_w >= x && tl_y <= y && tl_y+inner_h >= y);
+    // Every tile of a separable kernel recomputes k->height-1 rows, so keep them tall enough
+    // to make that negligible
+    *tile_h = tile_height_override;
+    if (!*tile_h) { *tile_h = MAX((int)(budget / (size_t) *tile_w), 16 * k->height); }
 }
 
-int image_convolve(struct image *img, struct kernel *k){
-    // Calculate required padding
+// Arguments shared by the bands of a parallel convolution
+struct convolve_job {
+    struct image *src;          // The image to convolve
+    struct image *dest;         // Receives the result, same dimensions as src
+    struct kernel *k;
+    convolve_row_fn convolve_row;
+    convolve_hpass_fn hpass;
+    convolve_vpass_fn vpass;
+    int inner_w, inner_h;
+    enum border_mode border;
+    unsigned char *zeros;       // A black row, standing in for rows beyond the image
+    int tile_w, tile_h;         // The size of the blocks each band is processed in
+    atomic_int failed;          // Set by any band failing to allocate
+};
+
+// Returns the first pixel of the source row sampled for (inner) row y, NULL if black
+static unsigned char *convolve_source_row(struct convolve_job *job, int y){
+    struct image *img = job->src;
+    y = border_index(y, job->inner_h, job->border);
+    if (y < 0) { return NULL; }
+    return image_inner_row(img, y);
+}
+
+// Splits the columns [x0, x1) into those whose taps all lie within the image,
+// [*inner_x0, *inner_x1), and those on either side that sample beyond the edges
+static void convolve_split_columns(struct convolve_job *job, int x0, int x1,
+                                   int *inner_x0, int *inner_x1){
+    int half_w = job->k->width/2;
+    *inner_x0 = MIN(MAX(x0, half_w), x1);
+    *inner_x1 = MAX(MIN(x1, job->inner_w - (job->k->width - 1 - half_w)), *inner_x0);
+}
+
+// Gathers the samples of the source row `src` (NULL if black) under the taps of the
+// `count` pixels from column x, through the border mode
+static void convolve_gather_row(struct convolve_job *job, unsigned char *dest, 
+                                unsigned char *src, int x, int count){
+    int first = x - job->k->width/2;
+    for (int i = 0; i < count + job->k->width - 1; ++i){
+        int src_x = border_index(first + i, job->inner_w, job->border);
+        dest[i] = src && src_x >= 0 ? src[src_x] : 0;
+    }
+}
+
+// Convolves `count` pixels from column x of a row with a 2D kernel, where some taps lie
+// beyond the edges. The samples are gathered first, so the same row routine applies.
+static void convolve_border_run(struct convolve_job *job, unsigned char *dest,
+                                unsigned char **src_rows, int x, int count){
+    struct kernel *k = job->k;
+    unsigned char samples[k->height][count + k->width - 1];
+    unsigned char *rows[k->height];
+    for (int ky = 0; ky < k->height; ++ky){
+        convolve_gather_row(job, samples[ky], src_rows[ky], x, count);
+        rows[ky] = samples[ky];
+    }
+    job->convolve_row(dest, rows, k, count);
+}
+
+// Convolves a tile of the inner image with a 2D kernel, the tile being `count`
+// columns starting at inner column x0, over the rows [y0, y1)
+static void convolve_tile(struct convolve_job *job, int x0, int count, int y0, int y1){
+    struct kernel *k = job->k;
     int half_w = k->width/2, half_h = k->height/2;
-    int req_padding = MAX(half_w, half_h);
-    if (img->padding < req_padding) { 
-        fprintf(stderr, "%s\tNot enough padding for convolution. \n\t\tAborting convolution.",
-                WARN_TXT);
-        return 0; 
+    int vectorized = k->width == 3 && k->height == 3;
+    int inner_x0, inner_x1;
+    convolve_split_columns(job, x0, x0 + count, &inner_x0, &inner_x1);
+
+    // Apply the kernel matrix on each byte of the inner image (skipping the padding)
+    unsigned char *src_rows[k->height];
+    unsigned char *rows[k->height];
+    for (int y = y0; y < y1; ++y){
+        // Point at the source rows covered by the kernel, shifted to its left edge
+        for (int ky = 0; ky < k->height; ++ky){
+            src_rows[ky] = convolve_source_row(job, y + ky - half_h);
+            rows[ky] = (src_rows[ky] ? src_rows[ky] : job->zeros) + inner_x0 - half_w;
+        }
+        unsigned char *dest = image_inner_row(job->dest, y);
+
+        // 3x3 kernels have a vectorized path, leaving only the row remainder to the routine
+        int x = 0, inner_count = inner_x1 - inner_x0;
+        if (vectorized && inner_count){
+            x = k->ivalues ? simd_convolve_row_3x3_int(&dest[inner_x0], rows, k, inner_count)
+                           : simd_convolve_row_3x3(&dest[inner_x0], rows, k, inner_count);
+            for (int ky = 0; ky < k->height; ++ky){ rows[ky] += x; }
+        }
+        if (inner_count) { job->convolve_row(&dest[inner_x0 + x], rows, k, inner_count - x); }
+
+        // The columns near the left and right edges
+        if (inner_x0 > x0) { convolve_border_run(job, &dest[x0], src_rows, x0, inner_x0 - x0); }
+        if (x0 + count > inner_x1){
+            convolve_border_run(job, &dest[inner_x1], src_rows, inner_x1, x0 + count - inner_x1);
+        }
+    }
+}
+
+// Applies the horizontal pass to `count` pixels from column x0 of the source row `src`
+static void convolve_hpass_row(struct convolve_job *job, float *dest, unsigned char *src,
+                               int x0, int count){
+    struct kernel *k = job->k;
+    int half_w = k->width/2;
+    int inner_x0, inner_x1;
+    convolve_split_columns(job, x0, x0 + count, &inner_x0, &inner_x1);
+
+    if (inner_x1 > inner_x0){
+        job->hpass(&dest[inner_x0 - x0], &src[inner_x0 - half_w], k, inner_x1 - inner_x0);
+    }
+
+    // The columns near the left and right edges sample through the border mode
+    int runs[2][2] = { { x0, inner_x0 }, { inner_x1, x0 + count } };
+    for (int r = 0; r < 2; ++r){
+        int run = runs[r][1] - runs[r][0];
+        if (run <= 0) { continue; }
+        unsigned char samples[run + k->width - 1];
+        convolve_gather_row(job, samples, src, runs[r][0], run);
+        job->hpass(&dest[runs[r][0] - x0], samples, k, run);
+    }
+}
+
+// Convolves a tile of the inner image with a separable kernel, as a horizontal pass
+// followed by a vertical pass. Horizontally filtered rows are kept in `ring`, 
+// only k->height rows of `count` floats.
+static void convolve_separable_tile(struct convolve_job *job, float *ring, 
+                                    int x0, int count, int y0, int y1){
+    struct kernel *k = job->k;
+    int half_h = k->height/2;
+
+    // The first and last source rows touched by the kernel
+    int first_y = y0 - half_h;
+    int last_y = y1 - 1 + (k->height - 1 - half_h);
+    float *rows[k->height];
+    for (int y = first_y; y <= last_y; ++y){
+        // Horizontal pass of row y into its slot in the ring, black rows filtering to 0
+        float *h_row = &ring[(size_t)((y - first_y) % k->height) * count];
+        unsigned char *src = convolve_source_row(job, y);
+        if (src) { convolve_hpass_row(job, h_row, src, x0, count); }
+        else { memset(h_row, 0, sizeof(float) * count); }
+
+        // Wait until the ring holds every row needed for the next output row
+        if (y - first_y < k->height - 1) { continue; }
+        int out_y = y - (k->height - 1) + half_h;
+        
+        // Vertical pass over the buffered rows
+        for (int ky = 0; ky < k->height; ++ky){
+            int slot = (out_y - half_h + ky - first_y) % k->height;
+            rows[ky] = &ring[(size_t)slot * count];
+        }
+        job->vpass(image_inner_row(job->dest, out_y) + x0, rows, k, count);
     }
+}
+
+// Convolves the (inner) rows [y0, y1), one tile at a time
+static void convolve_band(void *arg, int y0, int y1){
+    struct convolve_job *job = arg;
+    
+    float *ring = NULL;
+    if (job->k->row){
+        ring = scratch_alloc(sizeof(float) * (size_t) MIN(job->tile_w, job->inner_w) 
+                             * job->k->height);
+        if (!ring) { atomic_store_explicit(&job->failed, 1, memory_order_relaxed); return; }
+    }
+
+    for (int ty = y0; ty < y1; ty += job->tile_h){
+        int ty1 = MIN(ty + job->tile_h, y1);
+        for (int tx = 0; tx < job->inner_w; tx += job->tile_w){
+            int count = MIN(job->tile_w, job->inner_w - tx);
+            if (ring) { convolve_separable_tile(job, ring, tx, count, ty, ty1); }
+            else { convolve_tile(job, tx, count, ty, ty1); }
+        }
+    }
+}
+
+int image_convolve_into(struct image *dest, struct image *src, struct kernel *k){
     // TODO add striding
-    if (img->channels != 1) { 
+    if (src->channels != 1) { 
         fprintf(stderr, "%s\tToo many channels for convolution. \n\t\tAborting convolution.",
                 WARN_TXT);
         return 0; 
     }
+    if (dest->width != src->width || dest->height != src->height || 
+        dest->channels != src->channels || dest->padding != src->padding || 
+        image_row(dest, 0) == image_row(src, 0)) {
+        fprintf(stderr, "%s\tInvalid convolution destination. \n\t\tAborting convolution.",
+                WARN_TXT);
+        return 0;
+    }
+        
+    struct convolve_job job = { 
+        .src = src, .dest = dest, .k = k, 
+        .inner_w = src->width - src->padding*2, .inner_h = src->height - src->padding*2,
+        .border = border_mode,
+    };
+    size_t mark = scratch_mark();
+    atomic_init(&job.failed, 0);
+    convolve_tile_size(k, &job.tile_w, &job.tile_h);
+    if (fft_convolve_preferred(k)){
+        // Large kernels are cheaper to apply in the frequency domain
+        atomic_store(&job.failed, !fft_convolve(dest, src, k));
+    }
+    else if (k->row && k->col){
+        // Separable kernels are cheaper to apply as two 1D passes. 
+        // Pick the generated passes for the common gaussian sizes
+        job.hpass = convolve_hpass;
+        job.vpass = convolve_vpass;
+        if (k->width == 5) { job.hpass = convolve_hpass_5; }
+        else if (k->width == 7) { job.hpass = convolve_hpass_7; }
+        if (k->height == 5) { job.vpass = convolve_vpass_5; }
+        else if (k->height == 7) { job.vpass = convolve_vpass_7; }
+    }
+    else { 
+        job.convolve_row = convolve_row_select(k); 
+        atomic_store(&job.failed, !(job.zeros = scratch_alloc(MAX(job.inner_w, 1))));
+        if (job.zeros) { memset(job.zeros, 0, MAX(job.inner_w, 1)); }
+    }
+    if (!atomic_load(&job.failed) && (job.hpass || job.convolve_row)){
+        threadpool_run_bands(0, job.inner_h, convolve_band, &job);
+    }
+    scratch_reset(mark);
+    
+    if (atomic_load(&job.failed)){
+        fprintf(stderr, "%s\tFailed to allocate convolution buffers. \n\t\tAborting convolution.",
+                WARN_TXT);
+        return 0;
+    }
+    return 1;
+}
 
+int image_convolve(struct image *img, struct kernel *k){
     // Allocate memory for the convolution result
-    struct image *tmp_img = image_clone(img);
+    size_t mark = scratch_mark();
+    struct image *tmp_img = scratch_image(img);
     if (!tmp_img) { 
-        fprintf(stderr, "%s\tFailed to clone image. \n\t\tAborting convolution.",
+        fprintf(stderr, "%s\tFailed to allocate image. \n\t\tAborting convolution.",
                 WARN_TXT);
         return 0;
     }
-        
-    // Apply the kernel matrix on each byte of the image
-    size_t image_size = img->width * img->height;
-    size_t top_left = img->width * img->padding + img->padding;
-    size_t bottom_right = image_size - top_left;
-    for (size_t i = top_left; i < bottom_right; ++i){
-        if (!inner_image_contains(img, i)){continue;}
+    if (!image_convolve_into(tmp_img, img, k)) { scratch_reset(mark); return 0; }
 
-        // Create a value to store the result of the selected cell
-        float cell = 0.0;
+    // Copy the inner image of tmp_img back into the passed image
+    size_t row_size = (size_t)(img->width - img->padding*2) * img->channels;
+    for (int y = 0; y < img->height - img->padding*2; ++y){
+        memcpy(image_inner_row(img, y), image_inner_row(tmp_img, y), row_size);
+    }
+    scratch_reset(mark);
+    return 1;
+}
 
-        // Apply each value from the kernel to the respective offset in the image
-        for (int ky = 0; ky < k->height; ++ky){
-            for (int kx = 0; kx < k->width; ++kx){
-                float k_val = k->values[ky][kx];
-                int offset = (kx - half_w) + (ky - half_h) * img->width;
-                // Sum the product of the kernel and the offset cell
-                cell += k_val * (float)(img->data[offset+i]);
-            }
+// Converts the rows [y0, y1) of an rgb(a) image to grayscale
+static void grayscale_band(void *arg, int y0, int y1){
+    struct image *img = arg;
+    size_t row_size = (size_t) img->width * img->channels;
+    // Note: infinite loop if img->channels == 0
+    for (int y = y0; y < y1; ++y){
+        unsigned char *row = image_row(img, y);
+        for (size_t i = 0; i < row_size; i+=img->channels){
+            // Map the color channels to pointer references
+            unsigned char *r = &row[i];
+            unsigned char *g = &row[i+1];
+            unsigned char *b = &row[i+2];
+
+            // Create floats of each color channel
+            float dec_r = (float)(*r), dec_g = (float)(*g), dec_b = (float)(*b);
+            // Calculate and clamp the grayscale using weighted values
+            float grayscale = 0.299*dec_r + 0.587*dec_g + 0.144*dec_b;
+            if (grayscale > 255.0) { grayscale = 255.0; }
+            else if (grayscale < 0.0) { grayscale = 0.0; }
+            
+            // Convert back to a byte
+            unsigned char gray_byte = (unsigned char) (roundf(grayscale));
+            *r = gray_byte; *b = gray_byte; *g = gray_byte;
         }
-        
-        // Apply the divisor after all summing is complete
-        cell /= k->divisor;
-        // Clamp the cell's result to a byte
-        cell = roundf(cell);
-        if (cell > 255.0) { cell = 255.0; }
-        else if (cell < 0.0) { cell = 0.0; }
-        // Store into a new image for final result
-        tmp_img->data[i] = (unsigned char) cell;
-    }
-    // Move tmp_img's data into the passed image
-    memmove(img->data, tmp_img->data, img->width*img->height*img->channels);
-    image_free(tmp_img);
-    return 1;
+    }
 }
 
 int filter_grayscale(struct image *img){
-    //TODO allow processing of padded images
-    if (img->padding) { return 0; }
-
     // Return failure if one of the image parameters is 0
     if (!img->channels || !img->width || !img->height) { return 0; }
     // Only supporting 3 and 4 channel rgb(a) images 
     // TODO allow arbitrary channels/schemes?
     if (img->channels != 3 && img->channels != 4) { return 0; }
 
-    size_t img_size = (size_t) (img->width * img->height * img->channels);
-    // Note: infinite loop if img->channels == 0
-    for (size_t i = 0; i < img_size; i+=img->channels){
-        // Map the color channels to pointer references
-        unsigned char *r = &img->data[i];
-        unsigned char *g = &img->data[i+1];
-        unsigned char *b = &img->data[i+2];
-
-        // Create floats of each color channel
-        float dec_r = (float)(*r), dec_g = (float)(*g), dec_b = (float)(*b);
-        // Calculate and clamp the grayscale using weighted values
-        float grayscale = 0.299*dec_r + 0.587*dec_g + 0.144*dec_b;
-        if (grayscale > 255.0) { grayscale = 255.0; }
-        else if (grayscale < 0.0) { grayscale = 0.0; }
-        
-        // Convert back to a byte
-        unsigned char gray_byte = (unsigned char) (roundf(grayscale));
-        *r = gray_byte; *b = gray_byte; *g = gray_byte;
-    }
-
+    threadpool_run_bands(0, img->height, grayscale_band, img);
     return 1;
 }
 
-struct kernel *kernel_create(int h, int w, float div, float vals[h][w]){
-    // Allocate space for the struct and the dynamic array of pointers
-    struct kernel *k = malloc(sizeof(struct kernel) + sizeof(float*[h]));
+// Allocates and populates a kernel as a single block, from `arena` (or the heap if NULL).
+// row and col are the factors of separable kernels, NULL otherwise.
+static struct kernel *kernel_init(struct arena *arena, int h, int w, float div, 
+                                  float vals[h][w], float row[w], float col[h]){
+    // The struct and its row pointers are followed by the values, their integer copy
+    // and the factors
+    size_t size = sizeof(struct kernel) + sizeof(float*[h]) + sizeof(float[h][w]) 
+                  + sizeof(int[h][w]) + (row ? sizeof(float[w]) + sizeof(float[h]) : 0);
+    struct kernel *k = arena ? arena_alloc(arena, size) : mem_malloc(size);
     if (!k) { return 0; }
+    float *values = (float *) &k->values[h];
+    int *ivalues = (int *) &values[h*w];
     
     // Copy the vals into the dynamically allocated memory
     k->width = w; k->height = h; k->divisor = div;
+    k->row = 0; k->col = 0;
+    k->ivalues = 0; k->idivisor = 0; k->abs_sum = 0; k->div_mul = 0;
     for (int y = 0; y < h; ++y){
-        if (!(k->values[y] = malloc(sizeof(float[w])))) { return 0; }
+        k->values[y] = &values[y*w];
         for (int x = 0; x < w; ++x){
             k->values[y][x] = vals[y][x];
         }
     }
+
+    // Keep a copy of each factor for the 1D passes
+    if (row){
+        k->row = (float *) &ivalues[h*w];
+        k->col = &k->row[w];
+        memcpy(k->row, row, sizeof(float[w]));
+        memcpy(k->col, col, sizeof(float[h]));
+    }
+
+    // Whole numbered kernels can also be applied with integer arithmetic. The limits keep
+    // every sum exact as a float and the divisor coarse enough that the float path can never
+    // round differently, so both paths produce identical results.
+    int is_integer = div == floorf(div) && div >= 1.0 && div <= 32767.0;
+    float abs_sum = 0.0;
+    for (int y = 0; y < h && is_integer; ++y){
+        for (int x = 0; x < w; ++x){
+            if (vals[y][x] != floorf(vals[y][x])) { is_integer = 0; break; }
+            abs_sum += fabsf(vals[y][x]);
+        }
+    }
+    if (is_integer && abs_sum <= 65535.0){
+        k->ivalues = ivalues;
+        for (int y = 0; y < h; ++y){
+            for (int x = 0; x < w; ++x){ k->ivalues[y*w + x] = (int) vals[y][x]; }
+        }
+        k->idivisor = (int) div;
+        k->abs_sum = (int) abs_sum;
+
+        // ceil(2^shift / 2d) divides exactly over the clamped range while 256*(2d)^2 <= 2^shift
+        unsigned int d2 = 2 * (unsigned int) k->idivisor;
+        k->div_mul = 256u * d2 * d2 <= (1u << KERNEL_DIV_SHIFT) ?
+            ((1u << KERNEL_DIV_SHIFT) + d2 - 1) / d2 : 0;
+    }
     return k;
 }
 
+// Builds a separable kernel from its factors, from `arena` (or the heap if NULL)
+static struct kernel *kernel_init_separable(struct arena *arena, int h, int w, float div, 
+                                            float row[w], float col[h]){
+    // Build the full matrix as the outer product of the factors
+    float vals[h][w];
+    for (int y = 0; y < h; ++y){
+        for (int x = 0; x < w; ++x){
+            vals[y][x] = col[y] * row[x];
+        }
+    }
+    return kernel_init(arena, h, w, div, vals, row, col);
+}
+
+struct kernel *kernel_create(int h, int w, float div, float vals[h][w]){
+    return kernel_init(NULL, h, w, div, vals, NULL, NULL);
+}
+
+struct kernel *kernel_create_separable(int h, int w, float div, float row[w], float col[h]){
+    return kernel_init_separable(NULL, h, w, div, row, col);
+}
+
 void kernel_free(struct kernel *k){
-    // Deep free the values
-    for (int i = 0; i < k->height; ++i){ free(k->values[i]); }
-    // Free the struct
-    free(k);
+    // The values are allocated along with the struct
+    mem_free(k);
+}
+
+// Creates a kernel in the scratch arena, released with the arena
+static struct kernel *scratch_kernel(int h, int w, float div, float vals[h][w]){
+    struct arena *arena = processing_get_arena();
+    return arena ? kernel_init(arena, h, w, div, vals, NULL, NULL) : NULL;
+}
+
+// Creates a gaussian kernel, from `arena` (or the heap if NULL)
+static struct kernel *gaussian_kernel(struct arena *arena, int size, float weight){
+    if (size < 3 || weight <= 0.0) { return 0; }
+    
+    int offset = size/2;
+    float s = weight*weight*2.0;
+
+    // 1/(s*pi) * e^-((x^2+y^2)/s) == (1/sqrt(s*pi) * e^-(x^2/s)) * (1/sqrt(s*pi) * e^-(y^2/s))
+    float k[size];
+    for (int arr_i = 0; arr_i < size; ++arr_i){
+        int x = arr_i - offset;
+        k[arr_i] = 1.0 / sqrtf(s * M_PI) * powf(M_E, -((x*x)/s)); 
+    }
+    
+    return kernel_init_separable(arena, size, size, 1.0, k, k);
+}
+
+struct kernel *kernel_gaussian(int size, float weight){
+    return gaussian_kernel(NULL, size, weight);
 }
 
 
+static int gaussian_into(struct image *dest, struct image *src, int size, float sigma);
+
 int filter_LoG(struct image *img, float sigma){
     if (!img->height || !img->width) { return 0; }
     if (img->channels != 1) { return 0; }
@@ -141,47 +825,33 @@ int filter_LoG(struct image *img, float sigma){
         {  0, -1,  0 }
     };
 
-    struct kernel *gauss_k = kernel_gaussian(5, sigma);
-    if (!gauss_k) { return 0; }
-    
-    struct kernel *lap_k = kernel_create(3, 3, 1.0, k_vals);
+    size_t mark = scratch_mark();
+    struct kernel *lap_k = scratch_kernel(3, 3, 1.0, k_vals);
     if (!lap_k) { return 0; }
 
-    // Pad the image, if needed
-    struct image *padded_img = img;
-    int req_padding = MAX(
-            MAX(lap_k->width/2, gauss_k->width/2),
-            MAX(lap_k->height/2, gauss_k->height/2));
-    if (img->padding < req_padding) {
-        if (!(padded_img = image_pad(img, req_padding))) { 
-            fprintf(stderr, "\n%s\tFailed to pad image for convolution\n", WARN_TXT);
-            return 0;
-        }
+    // The blur is applied into an intermediate image, and the laplacian from it back into img
+    struct image *blurred = scratch_image(img);
+    if (!blurred) {
+        fprintf(stderr, "\n%s\tFailed to allocate image. \n\t\tAborting LoG.\n", WARN_TXT);
+        scratch_reset(mark);
+        return 0;
     }
 
     // Apply blur to denoise
-    if (!image_convolve(padded_img, gauss_k)){ 
+    int success = 0;
+    if (!gaussian_into(blurred, img, 5, sigma)){ 
         fprintf(stderr, "\n%s\tFailed gaussian filter convolution. \n\t\tAborting LoG.\n", 
                 WARN_TXT); 
-        return 0;
     }
-    kernel_free(gauss_k);
-    
     // Apply laplace filter for edge detection
-    if (!image_convolve(padded_img, lap_k)){ 
+    else if (!image_convolve_into(img, blurred, lap_k)){ 
         fprintf(stderr, "\n%s\tFailed laplacian filter convolution. \n\t\tAborting LoG.\n", 
                 WARN_TXT); 
-        return 0;
-    }
-    kernel_free(lap_k);
-    
-    // Unpad and cleanup, if needed
-    if (img != padded_img){
-        image_unpad_into(img, padded_img);
-        image_free(padded_img);
     }
+    else { success = 1; }
 
-    return 1;
+    scratch_reset(mark);
+    return success;
 }
 
 
@@ -197,19 +867,20 @@ int filter_scharr(struct image *img, int thinned){
         { -47, -162, -47 }
     };
 
-    struct kernel *kx = kernel_create(3, 3, 80.0, kx_vals);
-    struct kernel *ky = kernel_create(3, 3, 80.0, ky_vals);
-    if (!kx || !ky) { return 0; }
+    size_t mark = scratch_mark();
+    struct kernel *kx = scratch_kernel(3, 3, 80.0, kx_vals);
+    struct kernel *ky = scratch_kernel(3, 3, 80.0, ky_vals);
+    if (!kx || !ky) { scratch_reset(mark); return 0; }
 
     filter_two_pass(img, kx, ky, thinned);
 
-    kernel_free(kx); 
-    kernel_free(ky);
+    scratch_reset(mark);
     return 1;
 }
 
 
-int filter_sobel(struct image *img, int thinned){
+// Creates the pair of Sobel kernels in the scratch arena, for filter_sobel() and filter_canny()
+static int kernels_sobel(struct kernel **kx, struct kernel **ky){
     static float kx_vals[3][3] = {
         { 1, 0, -1 },
         { 2, 0, -2 },
@@ -221,273 +892,1238 @@ int filter_sobel(struct image *img, int thinned){
         { -1, -2, -1 }
     };
 
+    *kx = scratch_kernel(3, 3, 4.0, kx_vals);
+    *ky = scratch_kernel(3, 3, 4.0, ky_vals);
+    return *kx && *ky;
+}
+
+int filter_sobel(struct image *img, int thinned){
     // Sanity checks
     if (img->channels != 1) { return 0; }
     if (!img->width || !img->height) { return 0; }
     
-    struct kernel *kx = kernel_create(3, 3, 4.0, kx_vals);
-    struct kernel *ky = kernel_create(3, 3, 4.0, ky_vals);
-    if (!kx || !ky) { return 0; }
+    size_t mark = scratch_mark();
+    struct kernel *kx, *ky;
+    if (!kernels_sobel(&kx, &ky)) { scratch_reset(mark); return 0; }
 
     filter_two_pass(img, kx, ky, thinned);
 
-    kernel_free(kx); 
-    kernel_free(ky);
+    scratch_reset(mark);
     return 1;
 }
 
 
-int filter_two_pass(struct image *img, struct kernel *k1, struct kernel *k2, int thinned){
-    //TODO allow for passing gradient formula/functions. As is stands, sobel's is implemented
+// The fractional bits the gradients are kept with, when the kernels' range allows
+#define GRADIENT_FRAC_BITS 4
+// The pixels the fused gradient sweeps at a time, their gradients staying in L1 until
+// the magnitude is taken
+#define GRADIENT_CHUNK 256
 
-    // Sanity checks
-    if (img->channels != 1) { return 0; }
-    if (!img->width || !img->height) { return 0; }
+// The axis of the gradient, quantized to the line of neighbours it points between
+// (with y pointing down)
+enum dir { DIR_HORIZ, DIR_VERT, DIR_DIAG_DOWN, DIR_DIAG_UP };
 
-    // Pad the image, if needed
-    struct image *padded_img_x = img;
-    int req_padding = MAX(
-            MAX(k1->width/2, k2->width/2),
-            MAX(k1->height/2, k2->height/2));
-    if (img->padding < req_padding) {
-        if (!(padded_img_x = image_pad(img, req_padding))) { 
-            fprintf(stderr, "\n%s\tFailed to pad image for convolution\n", WARN_TXT);
-            return 0;
-        }
-    }
+// Directions are kept 2 bits per pixel, 4 pixels to a byte. Every row starts on a new
+// byte, so that bands never write to the same one.
+#define DIR_ROW_SIZE(width) (((size_t)(width) + 3) / 4)
 
-    // Clone the padded image for a separate pass
-    struct image *padded_img_y;
-    if (!(padded_img_y=image_clone(padded_img_x))){
-        fprintf(stderr, "\n%s\tFailed to clone image for convolution\n", WARN_TXT);
-        return 0;
-    }
+static inline enum dir dir_get(const unsigned char *row, int x){
+    return (enum dir)((row[x >> 2] >> ((x & 3) * 2)) & 3);
+}
 
-    // Convolve the image with first kernel
-    if (!image_convolve(padded_img_y, k1)){ 
-        fprintf(stderr, "\n%s\tFailed first convolution. \n\t\tAborting\n", 
-                WARN_TXT); 
-        return 0;
+// The bins of a histogram of gradient magnitude, one per 8 bit value
+#define GRADIENT_HISTOGRAM_BINS 256
+
+// A histogram of gradient magnitude, counting the (inner) rows [y0, y1) as they are computed
+struct gradient_histogram {
+    atomic_size_t *bins;
+    int y0, y1;
+};
+
+// Arguments shared by the bands of the stages of two_pass_into()
+struct gradient_job {
+    struct image *src;
+    struct kernel *kx, *ky;
+    int16_t *gx, *gy;       // The signed gradients of the inner image, unused when fused
+    float scale_x, scale_y; // Map a kernel's sum to fixed point, dividing by its divisor
+    int frac_bits;          // The fractional bits of the gradients
+    enum gradient_norm norm;
+    struct image *mag;      // Receives the gradient magnitude
+    unsigned char *dirs;    // Receives the direction of each inner pixel, NULL if unused
+    struct image *dest;     // Receives the thinned edges
+    unsigned char *zeros;   // A black row, standing in for rows beyond the image when fused
+    struct gradient_histogram *histogram;   // Counts the magnitude, NULL if unused
+    int inner_w, inner_h;
+    int margin;             // The columns gathered beyond each edge of a row
+    int above, below;       // The rows of the window above and below each output row
+    enum border_mode border;
+    atomic_int failed;      // Set by any band failing to allocate
+};
+
+// Returns the fractional bits that keep every response of k within an int16
+static int gradient_frac_bits(struct kernel *k){
+    float abs_sum = 0.0;
+    for (int y = 0; y < k->height; ++y){
+        for (int x = 0; x < k->width; ++x){ abs_sum += fabsf(k->values[y][x]); }
     }
+    int bits = GRADIENT_FRAC_BITS;
+    while (bits > 0 && 255.0f * abs_sum / k->divisor * (1 << bits) > INT16_MAX) { bits--; }
+    return bits;
+}
 
-    if (!image_convolve(padded_img_x, k2)){ 
-        fprintf(stderr, "\n%s\tFailed second convolution. \n\t\tAborting.\n", 
-                WARN_TXT); 
-        return 0;
-    }
+// Rounds like roundf() and clamps to +-INT16_MAX, so that (|gx| + |gy|)^2 fits an unsigned int.
+// Truncating through an int vectorizes without SSE4.1, and as v - trunc(v) is exact the
+// halfway cases round away from zero as they should.
+static inline int gradient_round(float v){
+    v = MIN(MAX(v, (float) -INT16_MAX), (float) INT16_MAX);
+    int t = (int) v;
+    float frac = v - (float) t;
+    return t + (frac >= 0.5f) - (frac <= -0.5f);
+}
 
-    if (thinned){
-        enum dir { VERT, HORIZ, DIAG_FORW, DIAG_BACK };
-    
-        int img_size = padded_img_x->width * padded_img_x->height;
-        enum dir dirs[img_size];
-        for (int i = 0; i < img_size; ++i){
-            float gy = (float)padded_img_y->data[i];
-            float gx = (float)padded_img_x->data[i];
-
-            float angle = atan2(gy, gx);
-            if ((angle <= 0.f && angle > -1.f * M_PI / 8.f) || 
-                (angle > 0.f && angle <= 1.f * M_PI / 8.f ) || 
-                (angle <= 1.f * M_PI && angle > 7.f * M_PI / 8.f) ||
-                (angle > -1.f * M_PI && angle <= -7.f * M_PI / 8.f)){
-
-                dirs[i] = HORIZ;
-            }
-            else if ((angle > 1.f * M_PI / 8.f && angle <= 3.f * M_PI / 8.f) ||
-                     (angle <= -1.f * M_PI / 8.f && angle > -3.f * M_PI / 8.f)){
-                dirs[i] = DIAG_FORW;
-            }
-            else if ((angle > 3.f * M_PI / 8.f && angle <= 5.f * M_PI / 8.f) ||
-                     (angle <= -3.f * M_PI / 8.f && angle > -5.f * M_PI / 8.f)){
-                dirs[i] = VERT;
-            }
-            // TODO fix issue with DIAG_BACK angle detection?
-            else if ((angle > 5.f * M_PI / 8.f && angle <= 7.f * M_PI / 8.f) ||
-                     (angle <= -5.f * M_PI / 8.f && angle > -7.f * M_PI / 8.f)){
-                dirs[i] = DIAG_BACK;
-            }
-        }
- 
-        image_merge_add(padded_img_x, padded_img_y);
-        image_free(padded_img_y);
-
-        for (int i = 0; i < img_size; ++i){
-            unsigned char *cell, *a, *b;
-            cell = &padded_img_x->data[i];
-            int width = padded_img_x->width;
-            switch (dirs[i]){
-                case HORIZ:
-                    a = &padded_img_x->data[i-width];
-                    b = &padded_img_x->data[i+width];
-                    break;
-                case VERT:
-                    a = &padded_img_x->data[i-1];
-                    b = &padded_img_x->data[i+1];
-                    break;
-                case DIAG_FORW:
-                    a = &padded_img_x->data[i+1-width];
-                    b = &padded_img_x->data[i-1+width];
-                    break;
-                case DIAG_BACK:
-                    a = &padded_img_x->data[i-1-width];
-                    b = &padded_img_x->data[i+1+width];
-                    break;
-                default: break;
-            }
+// Quantizes the direction of the gradient (gx, gy), branch free so that it vectorizes.
+// The gradient lies within 22.5 degrees of the x axis when |gy| < |gx| tan(22.5), and as 
+// tan(22.5) = sqrt(2) - 1 that is |gx| + |gy| < sqrt(2) |gx|. Squared, it compares integers
+// exactly (never equal unless both are 0, which is taken as horizontal).
+static inline unsigned char gradient_dir(int gx, int gy){
+    unsigned int ax = (unsigned int) abs(gx), ay = (unsigned int) abs(gy);
+    unsigned int sum_sq = (ax + ay) * (ax + ay);
+    unsigned char diag = (gx ^ gy) < 0 ? DIR_DIAG_UP : DIR_DIAG_DOWN;
+    unsigned char dir = sum_sq < 2 * ay * ay ? DIR_VERT : diag;
+    return sum_sq <= 2 * ax * ax ? DIR_HORIZ : dir;
+}
 
-            if (*cell < *a || *cell < *b) { *cell = 0;}
-        }
- 
-        if (img != padded_img_x){
-            image_unpad_into(img, padded_img_x);
-            image_free(padded_img_x);
+// Computes the magnitude, and the direction if `dirs` is not NULL, of the `count` pixels 
+// of a row from column x0, given their gradients. The row of directions must start zeroed.
+static void gradient_magnitude_run(struct gradient_job *job, const int16_t *gx, 
+                                   const int16_t *gy, int count, unsigned char *mag, 
+                                   unsigned char *dirs, int x0){
+    if (job->norm == GRADIENT_L2){
+        float unit = 1.0f / (1 << job->frac_bits);
+        for (int x = 0; x < count; ++x){
+            float cell = sqrtf((float) gx[x]*gx[x] + (float) gy[x]*gy[x]) * unit;
+            mag[x0 + x] = (unsigned char) MIN(gradient_round(cell), 255);
         }
     }
     else {
-        image_merge_add(padded_img_x, padded_img_y);
-        image_free(padded_img_y);
-        
-        if (img != padded_img_x){
-            image_unpad_into(img, padded_img_x);
-            image_free(padded_img_x);
+        int bits = job->frac_bits, half = (1 << bits) >> 1;
+        for (int x = 0; x < count; ++x){
+            int cell = (abs(gx[x]) + abs(gy[x]) + half) >> bits;
+            mag[x0 + x] = (unsigned char) MIN(cell, 255);
+        }
+    }
+    if (!dirs) { return; }
+
+    // Quantize a chunk at a time, then pack it
+    unsigned char chunk[GRADIENT_CHUNK];
+    for (int done = 0; done < count; done += GRADIENT_CHUNK){
+        int n = MIN(count - done, GRADIENT_CHUNK);
+        for (int x = 0; x < n; ++x){ chunk[x] = gradient_dir(gx[done + x], gy[done + x]); }
+        for (int x = 0; x < n; ++x){
+            int i = x0 + done + x;
+            dirs[i >> 2] |= (unsigned char)(chunk[x] << ((i & 3) * 2));
         }
     }
+}
 
-    return 1;
+// Gathers (inner) row y of the source through the border mode, with job->margin
+// samples beyond either edge
+static void gradient_gather_row(struct gradient_job *job, unsigned char *dest, int y){
+    int src_y = border_index(y, job->inner_h, job->border);
+    if (src_y < 0) { memset(dest, 0, job->inner_w + job->margin*2); return; }
+
+    unsigned char *src = image_inner_row(job->src, src_y);
+    memcpy(&dest[job->margin], src, job->inner_w);
+    for (int i = 0; i < job->margin; ++i){
+        int left = border_index(i - job->margin, job->inner_w, job->border);
+        int right = border_index(job->inner_w + i, job->inner_w, job->border);
+        dest[i] = left >= 0 ? src[left] : 0;
+        dest[job->margin + job->inner_w + i] = right >= 0 ? src[right] : 0;
+    }
 }
 
+// The slot of the gathered row y in a ring of `rows` rows
+static inline int gradient_ring_slot(int y, int rows){ return ((y % rows) + rows) % rows; }
+
+// Applies k to the gathered rows around (inner) row y, storing the fixed point result
+static void gradient_row(struct gradient_job *job, struct kernel *k, float scale, 
+                         int16_t *out, unsigned char *ring, int y){
+    int span = job->inner_w + job->margin*2, rows = job->above + job->below + 1;
+    unsigned char *taps[k->height];
+    for (int ky = 0; ky < k->height; ++ky){
+        int slot = gradient_ring_slot(y + ky - k->height/2, rows);
+        taps[ky] = &ring[(size_t) slot * span + job->margin - k->width/2];
+    }
 
-struct kernel *kernel_gaussian(int size, float weight){
-    if (size < 3 || weight <= 0.0) { return 0; }
-    
-    int offset = size/2;
-    float s = weight*weight*2.0;
+    for (int x = 0; x < job->inner_w; ++x){
+        float cell = 0.0;
+        if (k->ivalues){
+            int sum = 0;
+            for (int ky = 0; ky < k->height; ++ky){
+                for (int kx = 0; kx < k->width; ++kx){
+                    sum += k->ivalues[ky*k->width + kx] * taps[ky][x + kx];
+                }
+            }
+            cell = (float) sum;
+        }
+        else {
+            for (int ky = 0; ky < k->height; ++ky){
+                for (int kx = 0; kx < k->width; ++kx){ 
+                    cell += k->values[ky][kx] * taps[ky][x + kx]; 
+                }
+            }
+        }
+        out[x] = (int16_t) gradient_round(cell * scale);
+    }
+}
+
+// Computes the signed gradients of the (inner) rows [y0, y1). Each source row is gathered 
+// once, into a ring holding the window of both kernels.
+static void gradient_band(void *arg, int y0, int y1){
+    struct gradient_job *job = arg;
+    int span = job->inner_w + job->margin*2, rows = job->above + job->below + 1;
+    unsigned char *ring = scratch_alloc((size_t) span * rows);
+    if (!ring) { atomic_store_explicit(&job->failed, 1, memory_order_relaxed); return; }
+
+    for (int y = y0; y < y1; ++y){
+        // Gather the row entering the window, or the whole window for the first row
+        for (int sy = y == y0 ? y - job->above : y + job->below; sy <= y + job->below; ++sy){
+            gradient_gather_row(job, &ring[(size_t) gradient_ring_slot(sy, rows) * span], sy);
+        }
+        gradient_row(job, job->kx, job->scale_x, &job->gx[(size_t) y * job->inner_w], ring, y);
+        gradient_row(job, job->ky, job->scale_y, &job->gy[(size_t) y * job->inner_w], ring, y);
+    }
+}
+
+// Counts the magnitude of (inner) row y into a band's counts, if the histogram covers it
+static void gradient_histogram_row(struct gradient_job *job, size_t *counts, int y,
+                                   const unsigned char *mag){
+    if (!job->histogram || y < job->histogram->y0 || y >= job->histogram->y1) { return; }
+    for (int x = 0; x < job->inner_w; ++x) { counts[mag[x]]++; }
+}
+
+// Adds a band's counts to the histogram
+static void gradient_histogram_merge(struct gradient_job *job, const size_t *counts){
+    if (!job->histogram) { return; }
+    for (int i = 0; i < GRADIENT_HISTOGRAM_BINS; ++i){
+        if (counts[i]){
+            atomic_fetch_add_explicit(&job->histogram->bins[i], counts[i], memory_order_relaxed);
+        }
+    }
+}
+
+// Computes the magnitude (and direction, if asked) of the (inner) rows [y0, y1)
+// from the gradient planes
+static void magnitude_band(void *arg, int y0, int y1){
+    struct gradient_job *job = arg;
+    size_t counts[GRADIENT_HISTOGRAM_BINS] = {0};
+    for (int y = y0; y < y1; ++y){
+        size_t row = (size_t) y * job->inner_w;
+        unsigned char *dirs = NULL;
+        if (job->dirs){
+            dirs = &job->dirs[y * DIR_ROW_SIZE(job->inner_w)];
+            memset(dirs, 0, DIR_ROW_SIZE(job->inner_w));
+        }
+        gradient_magnitude_run(job, &job->gx[row], &job->gy[row], job->inner_w,
+                               image_inner_row(job->mag, y), dirs, 0);
+        gradient_histogram_row(job, counts, y, image_inner_row(job->mag, y));
+    }
+    gradient_histogram_merge(job, counts);
+}
+
+/*
+ * Fused gradient routines, for pairs of small integer kernels (Sobel, Scharr and Roberts 
+ * Cross). Each takes both gradients of `count` pixels from a single read of their 
+ * neighbourhoods, where `rows` point at the left most tap of the first pixel. They round 
+ * exactly as gradient_row() does, so either path gives the same result.
+ */
+typedef void (*gradient_fused_fn)(struct gradient_job *job, int16_t *gx, int16_t *gy, 
+                                  unsigned char **rows, int count);
+
+#define DEFINE_GRADIENT_FUSED(K) \
+static void gradient_fused_##K##x##K(struct gradient_job *job, int16_t *gx, int16_t *gy, \
+                                     unsigned char **rows, int count){ \
+    int vx[K][K], vy[K][K]; \
+    unsigned char *src[K]; \
+    for (int ky = 0; ky < K; ++ky){ \
+        src[ky] = rows[ky]; \
+        for (int kx = 0; kx < K; ++kx){ \
+            vx[ky][kx] = job->kx->ivalues[ky*K + kx]; \
+            vy[ky][kx] = job->ky->ivalues[ky*K + kx]; \
+        } \
+    } \
+    float scale_x = job->scale_x, scale_y = job->scale_y; \
+    for (int x = 0; x < count; ++x){ \
+        int sum_x = 0, sum_y = 0; \
+        for (int ky = 0; ky < K; ++ky){ \
+            for (int kx = 0; kx < K; ++kx){ \
+                int px = src[ky][x+kx]; \
+                sum_x += vx[ky][kx] * px; \
+                sum_y += vy[ky][kx] * px; \
+            } \
+        } \
+        gx[x] = (int16_t) gradient_round((float) sum_x * scale_x); \
+        gy[x] = (int16_t) gradient_round((float) sum_y * scale_y); \
+    } \
+}
+
+// Roberts Cross
+DEFINE_GRADIENT_FUSED(2)
+// Sobel and Scharr
+DEFINE_GRADIENT_FUSED(3)
+
+// Returns the fused routine for the kernel pair, NULL if it has none
+static gradient_fused_fn gradient_fused_select(struct kernel *kx, struct kernel *ky){
+    if (!kx->ivalues || !ky->ivalues) { return NULL; }
+    if (kx->width != ky->width || kx->height != ky->height) { return NULL; }
+    if (kx->width == 2 && kx->height == 2) { return gradient_fused_2x2; }
+    if (kx->width == 3 && kx->height == 3) { return gradient_fused_3x3; }
+    return NULL;
+}
+
+// Computes the magnitude (and direction) of `count` pixels from column x of a row in one 
+// sweep, a chunk at a time
+static void gradient_fused_run(struct gradient_job *job, gradient_fused_fn fused, 
+                               unsigned char **rows, int x, int count, 
+                               unsigned char *mag, unsigned char *dirs){
+    int16_t gx[GRADIENT_CHUNK], gy[GRADIENT_CHUNK];
+    unsigned char *chunk_rows[job->kx->height];
+    for (int done = 0; done < count; done += GRADIENT_CHUNK){
+        int n = MIN(count - done, GRADIENT_CHUNK);
+        for (int ky = 0; ky < job->kx->height; ++ky){ chunk_rows[ky] = rows[ky] + done; }
+        fused(job, gx, gy, chunk_rows, n);
+        gradient_magnitude_run(job, gx, gy, n, mag, dirs, x + done);
+    }
+}
+
+// Computes the magnitude (and direction, if `dirs` is not NULL) of a row in one sweep,
+// given the source rows under the kernels (NULL where black)
+static void gradient_fused_row(struct gradient_job *job, gradient_fused_fn fused, 
+                               unsigned char **src_rows, unsigned char *mag, unsigned char *dirs){
+    int k_w = job->kx->width, k_h = job->kx->height;
+    int half_w = k_w/2;
+
+    // The columns whose taps all lie within the image, and the runs either side of them
+    int inner_x0 = MIN(half_w, job->inner_w);
+    int inner_x1 = MAX(job->inner_w - (k_w - 1 - half_w), inner_x0);
+    int runs[2][2] = { { 0, inner_x0 }, { inner_x1, job->inner_w } };
+
+    unsigned char *rows[k_h];
+    for (int ky = 0; ky < k_h; ++ky){
+        rows[ky] = (src_rows[ky] ? src_rows[ky] : job->zeros) + inner_x0 - half_w;
+    }
+    if (dirs) { memset(dirs, 0, DIR_ROW_SIZE(job->inner_w)); }
+    gradient_fused_run(job, fused, rows, inner_x0, inner_x1 - inner_x0, mag, dirs);
+
+    // The columns near the left and right edges sample through the border mode
+    for (int r = 0; r < 2; ++r){
+        int run = runs[r][1] - runs[r][0];
+        if (run <= 0) { continue; }
+        unsigned char samples[k_h][run + k_w - 1];
+        for (int ky = 0; ky < k_h; ++ky){
+            for (int i = 0; i < run + k_w - 1; ++i){
+                int src_x = border_index(runs[r][0] - half_w + i, job->inner_w, job->border);
+                samples[ky][i] = src_rows[ky] && src_x >= 0 ? src_rows[ky][src_x] : 0;
+            }
+            rows[ky] = samples[ky];
+        }
+        gradient_fused_run(job, fused, rows, runs[r][0], run, mag, dirs);
+    }
+}
+
+// Computes the magnitude (and direction, if asked) of the (inner) rows [y0, y1) straight
+// from the source, reading it once
+static void gradient_fused_band(void *arg, int y0, int y1){
+    struct gradient_job *job = arg;
+    gradient_fused_fn fused = gradient_fused_select(job->kx, job->ky);
+    int k_h = job->kx->height, half_h = k_h/2;
+
+    unsigned char *src_rows[k_h];
+    size_t counts[GRADIENT_HISTOGRAM_BINS] = {0};
+    for (int y = y0; y < y1; ++y){
+        for (int ky = 0; ky < k_h; ++ky){
+            int src_y = border_index(y + ky - half_h, job->inner_h, job->border);
+            src_rows[ky] = src_y < 0 ? NULL : image_inner_row(job->src, src_y);
+        }
+        unsigned char *dirs = job->dirs ? &job->dirs[y * DIR_ROW_SIZE(job->inner_w)] : NULL;
+        gradient_fused_row(job, fused, src_rows, image_inner_row(job->mag, y), dirs);
+        gradient_histogram_row(job, counts, y, image_inner_row(job->mag, y));
+    }
+    gradient_histogram_merge(job, counts);
+}
+
+// Suppresses the non-maximum magnitudes of a row of `width` pixels into dest, given the
+// magnitude of the rows above and below it (NULL beyond the edges of the image).
+// Neighbours beyond the edges of the image never suppress a pixel.
+static void nms_row(unsigned char *dest, const unsigned char *above, const unsigned char *mag,
+                    const unsigned char *below, const unsigned char *dirs, int width){
+    // The rows of the neighbours compared against in each direction, ahead (x + dx) and
+    // behind (x - dx)
+    static const int steps_x[4] = { 
+        [DIR_HORIZ] = 1, [DIR_VERT] = 0, [DIR_DIAG_DOWN] = 1, [DIR_DIAG_UP] = 1,
+    };
+    const unsigned char *ahead[4] = { 
+        [DIR_HORIZ] = mag, [DIR_VERT] = below, [DIR_DIAG_DOWN] = below, [DIR_DIAG_UP] = above,
+    };
+    const unsigned char *behind[4] = { 
+        [DIR_HORIZ] = mag, [DIR_VERT] = above, [DIR_DIAG_DOWN] = above, [DIR_DIAG_UP] = below,
+    };
+    for (int x = 0; x < width; ++x){
+        enum dir dir = dir_get(dirs, x);
+        int dx = steps_x[dir];
+        unsigned char cell = mag[x], a = 0, b = 0;
+        if (ahead[dir] && x + dx < width) { a = ahead[dir][x + dx]; }
+        if (behind[dir] && x >= dx) { b = behind[dir][x - dx]; }
+        dest[x] = (cell < a || cell < b) ? 0 : cell;
+    }
+}
+
+// Suppresses the non-maximum magnitudes of the (inner) rows [y0, y1).
+// The magnitude is read from job->mag and written to dest, so the result does not depend
+// on the order (or banding) that pixels are visited in.
+static void nms_band(void *arg, int y0, int y1){
+    struct gradient_job *job = arg;
+    int padding = job->mag->padding;
+    int inner_w = job->mag->width - padding*2, inner_h = job->mag->height - padding*2;
+    for (int y = y0; y < y1; ++y){
+        unsigned char *above = y > 0 ? image_inner_row(job->mag, y - 1) : NULL;
+        unsigned char *below = y < inner_h - 1 ? image_inner_row(job->mag, y + 1) : NULL;
+        nms_row(image_inner_row(job->dest, y), above, image_inner_row(job->mag, y), below,
+                &job->dirs[y * DIR_ROW_SIZE(inner_w)], inner_w);
+    }
+}
+
+// Applies the gradient kernels kx and ky to src and stores the gradient magnitude in dest,
+// thinning it if asked. dest may be src. buf must differ from both, and is required when
+// thinning (to keep the magnitude in) or when fusing in place, being optional otherwise.
+// The magnitude (before thinning) is counted into `histogram` unless it is NULL.
+static int two_pass_into(struct image *dest, struct image *src, 
+                         struct kernel *kx, struct kernel *ky, int thinned, struct image *buf,
+                         struct gradient_histogram *histogram){
+    size_t mark = scratch_mark();
+    int inner_w = src->width - src->padding*2, inner_h = src->height - src->padding*2;
+    int frac_bits = MIN(gradient_frac_bits(kx), gradient_frac_bits(ky));
+    struct gradient_job job = {
+        .src = src, .kx = kx, .ky = ky, 
+        .scale_x = (1 << frac_bits) / kx->divisor, .scale_y = (1 << frac_bits) / ky->divisor,
+        .frac_bits = frac_bits, .norm = gradient_norm,
+        .mag = thinned ? buf : dest, .dest = dest,
+        .dirs = thinned ? scratch_alloc(DIR_ROW_SIZE(inner_w) * inner_h) : NULL,
+        .histogram = histogram,
+        .inner_w = inner_w, .inner_h = inner_h,
+        .margin = MAX(kx->width, ky->width),
+        .above = MAX(kx->height/2, ky->height/2),
+        .below = MAX(kx->height - 1 - kx->height/2, ky->height - 1 - ky->height/2),
+        .border = border_mode,
+    };
+
+    // The fused sweep writes the magnitude while reading the source, so it cannot share it
+    int fused = gradient_fused_select(kx, ky) && (job.mag != src || buf);
+    if (fused && job.mag == src) { job.mag = buf; }
 
-    float k[size][size];
-    for (int arr_y = 0; arr_y < size; ++arr_y){
-        for (int arr_x = 0; arr_x < size; ++arr_x){
-            int x = arr_x - offset;
-            int y = arr_y - offset;
+    atomic_init(&job.failed, 0);
+    if (thinned && !job.dirs) { atomic_store(&job.failed, 1); }
+    else if (fused){
+        if ((job.zeros = scratch_alloc(inner_w + kx->width))){
+            memset(job.zeros, 0, inner_w + kx->width);
+            threadpool_run_bands(0, inner_h, gradient_fused_band, &job);
+        }
+        else { atomic_store(&job.failed, 1); }
+    }
+    else {
+        size_t plane_size = (size_t) inner_w * inner_h;
+        job.gx = scratch_alloc(sizeof(int16_t) * plane_size);
+        job.gy = scratch_alloc(sizeof(int16_t) * plane_size);
+        if (job.gx && job.gy) { threadpool_run_bands(0, inner_h, gradient_band, &job); }
+        else { atomic_store(&job.failed, 1); }
+        if (!atomic_load(&job.failed)) { threadpool_run_bands(0, inner_h, magnitude_band, &job); }
+    }
+    if (atomic_load(&job.failed)){
+        fprintf(stderr, "\n%s\tFailed to allocate gradient planes. \n\t\tAborting.\n", WARN_TXT);
+        scratch_reset(mark);
+        return 0;
+    }
 
-            k[arr_y][arr_x] = 1.0 / (s * M_PI) * powf(M_E, -((x*x+y*y)/s)); 
+    if (thinned) { threadpool_run_bands(0, inner_h, nms_band, &job); }
+    else if (job.mag != dest){
+        for (int y = 0; y < inner_h; ++y){
+            memcpy(image_inner_row(dest, y), image_inner_row(job.mag, y), inner_w);
         }
     }
+
+    scratch_reset(mark);
+    return 1;
+}
+
+// The rows beyond each output row that the gradient stage reads, thinning reading one more
+static int gradient_halo(struct kernel *kx, struct kernel *ky, int thinned){
+    int rows = MAX(MAX(kx->height/2, kx->height - 1 - kx->height/2),
+                   MAX(ky->height/2, ky->height - 1 - ky->height/2));
+    return rows + (thinned ? 1 : 0);
+}
+
+// The scratch memory the gradient stage needs per row of `width` pixels, besides images
+static size_t gradient_row_cost(struct kernel *kx, struct kernel *ky, int thinned, int width){
+    size_t cost = thinned ? DIR_ROW_SIZE(width) : 0;
+    if (!gradient_fused_select(kx, ky)) { cost += 2 * sizeof(int16_t) * width; }
+    return cost;
+}
+
+// Arguments for two_pass_strip()
+struct two_pass_strip {
+    struct kernel *kx, *ky;
+    int thinned;
+};
+
+// Applies filter_two_pass() to a strip
+static struct image *two_pass_strip(struct image *strip, struct image *buf, int y0, int y1,
+                                    void *arg){
+    (void) y0; (void) y1;
+    struct two_pass_strip *ctx = arg;
+    return two_pass_into(strip, strip, ctx->kx, ctx->ky, ctx->thinned, buf, NULL) ? strip 
+                                                                                 : NULL;
+}
+
+int filter_two_pass(struct image *img, struct kernel *k1, struct kernel *k2, int thinned){
+    // Sanity checks
+    if (img->channels != 1) { return 0; }
+    if (!img->width || !img->height) { return 0; }
+
+    // Thinning keeps the magnitude in an intermediate image, as does the fused sweep
+    // (falling back to the gradient planes without one)
+    int uses_buf = thinned || gradient_fused_select(k1, k2);
+
+    // Under a memory budget, large images are processed in strips
+    int inner_w = img->width - img->padding*2;
+    size_t stride = image_stride(inner_w, 1);
+    size_t cost = gradient_row_cost(k1, k2, thinned, inner_w);
+    int halo = gradient_halo(k1, k2, thinned);
+    int rows = strip_rows(img, halo, stride*2 + cost, (uses_buf ? stride : 0) + cost, 0);
+    if (rows){
+        struct two_pass_strip ctx = { .kx = k1, .ky = k2, .thinned = thinned };
+        return strip_apply(img, rows, halo, two_pass_strip, &ctx);
+    }
+
+    size_t mark = scratch_mark();
+    struct image *buf = uses_buf ? scratch_image(img) : NULL;
+    int success = 0;
+    if (thinned && !buf){
+        fprintf(stderr, "\n%s\tFailed to allocate images for convolution\n", WARN_TXT);
+    }
+    else { success = two_pass_into(img, img, k1, k2, thinned, buf, NULL); }
+
+    scratch_reset(mark);
+    return success;
+}
+
+
+// How far beyond each edge the recursive gaussian samples the border, in multiples of sigma
+#define RECURSIVE_GAUSSIAN_EXT 6.0
+
+// Arguments shared by the bands of filter_gaussian_recursive()
+struct recursive_gaussian_job {
+    struct image *src;
+    struct image *dest;     // Written only once src has been read entirely
+    float *buf;             // The inner image as floats, filtered in place
+    float *zeros;           // A row of zeros, standing in for rows beyond the image
+    int inner_w, inner_h;
+    int ext;                // The pixels sampled beyond each edge
+    enum border_mode border;
+    float B, b1, b2, b3;    // The filter coefficients, with b1-b3 pre-divided by b0
+    atomic_int failed;      // Set by any band failing to allocate
+};
+
+// Loads and filters the rows [y0, y1) of the buffer forwards then backwards.
+// The buffer holds job->ext extra rows above and below the inner image.
+static void recursive_gaussian_rows(void *arg, int y0, int y1){
+    struct recursive_gaussian_job *job = arg;
+    struct image *img = job->src;
+    int len = job->inner_w + job->ext*2;
+
+    // Rows are filtered in a line extended over the border, then cropped
+    float *line = scratch_alloc(sizeof(float) * len);
+    if (!line) { atomic_store_explicit(&job->failed, 1, memory_order_relaxed); return; }
+
+    for (int y = y0; y < y1; ++y){
+        float *row = &job->buf[(size_t) y * job->inner_w];
+        int src_y = border_index(y - job->ext, job->inner_h, job->border);
+        unsigned char *src = src_y < 0 ? NULL : image_inner_row(img, src_y);
+
+        // Beyond the sampled border the filter starts at rest
+        float w1 = 0.0, w2 = 0.0, w3 = 0.0;
+        for (int x = 0; x < len; ++x){
+            int src_x = x - job->ext;
+            if (src_x < 0 || src_x >= job->inner_w) {
+                src_x = border_index(src_x, job->inner_w, job->border); 
+            }
+            float sample = src && src_x >= 0 ? (float) src[src_x] : 0.0f;
+            float w0 = job->B * sample + job->b1 * w1 + job->b2 * w2 + job->b3 * w3;
+            line[x] = w0;
+            w3 = w2; w2 = w1; w1 = w0;
+        }
+        w1 = 0.0; w2 = 0.0; w3 = 0.0;
+        for (int x = len - 1; x >= 0; --x){
+            float w0 = job->B * line[x] + job->b1 * w1 + job->b2 * w2 + job->b3 * w3;
+            line[x] = w0;
+            w3 = w2; w2 = w1; w1 = w0;
+        }
+        memcpy(row, &line[job->ext], sizeof(float) * job->inner_w);
+    }
+}
+
+// Filters the (inner) columns [x0, x1) forwards then backwards, storing the result.
+// Whole rows of the column range are processed at a time to walk memory in order.
+static void recursive_gaussian_cols(void *arg, int x0, int x1){
+    struct recursive_gaussian_job *job = arg;
+    struct image *img = job->dest;
+    size_t w = (size_t) job->inner_w;
+    int rows = job->inner_h + job->ext*2;
     
-    return kernel_create(size, size, 1.0, k);
+    for (int y = 0; y < rows; ++y){
+        float *w0 = &job->buf[y * w];
+        float *w1 = y >= 1 ? w0 - w : job->zeros;
+        float *w2 = y >= 2 ? w0 - 2*w : job->zeros;
+        float *w3 = y >= 3 ? w0 - 3*w : job->zeros;
+        for (int x = x0; x < x1; ++x){
+            w0[x] = job->B * w0[x] + job->b1 * w1[x] + job->b2 * w2[x] + job->b3 * w3[x];
+        }
+    }
+    for (int y = rows - 1; y >= 0; --y){
+        float *w0 = &job->buf[y * w];
+        float *w1 = y < rows - 1 ? w0 + w : job->zeros;
+        float *w2 = y < rows - 2 ? w0 + 2*w : job->zeros;
+        float *w3 = y < rows - 3 ? w0 + 3*w : job->zeros;
+        for (int x = x0; x < x1; ++x){
+            w0[x] = job->B * w0[x] + job->b1 * w1[x] + job->b2 * w2[x] + job->b3 * w3[x];
+        }
+
+        // Only the rows of the inner image are stored
+        int inner_y = y - job->ext;
+        if (inner_y < 0 || inner_y >= job->inner_h) { continue; }
+        unsigned char *dest = image_inner_row(img, inner_y);
+        for (int x = x0; x < x1; ++x){ dest[x] = kernel_float_result(w0[x], 1.0); }
+    }
 }
 
+// Computes the filter coefficients from Young and van Vliet's parameter q
+static void recursive_gaussian_coefs(double q, struct recursive_gaussian_job *job){
+    double b0 = 1.57825 + 2.44413*q + 1.4281*q*q + 0.422205*q*q*q;
+    job->b1 = (2.44413*q + 2.85619*q*q + 1.26661*q*q*q) / b0;
+    job->b2 = -(1.4281*q*q + 1.26661*q*q*q) / b0;
+    job->b3 = (0.422205*q*q*q) / b0;
+    job->B = 1.0 - (job->b1 + job->b2 + job->b3);
+}
 
-int filter_gaussian(struct image *img, int size, float sigma){
-    struct kernel *k = kernel_gaussian(size, sigma);
-    if (!k) { return 0; }
+// Applies the recursive gaussian to src, storing the result in dest (which may be src)
+static int gaussian_recursive_into(struct image *dest, struct image *src, float sigma){
+    if (!src->width || !src->height) { return 0; }
+    if (src->channels != 1) { return 0; }
+    if (sigma < 0.5) { return 0; }
+
+    struct recursive_gaussian_job job = { 
+        .src = src, 
+        .dest = dest,
+        .inner_w = src->width - src->padding*2, 
+        .inner_h = src->height - src->padding*2,
+        .border = border_mode,
+    };
 
-    // Ensure image is padded
-    int req_padding = MAX(k->width/2, k->height/2);
-    struct image *padded_img = img;
-    if (img->padding < req_padding) {
-        if (!(padded_img = image_pad(img, req_padding))) { 
-            fprintf(stderr, "\n%s\tFailed to pad image for convolution\n", WARN_TXT);
-            return 0;
+    // The border is sampled long enough for the filter to settle on it, and for the
+    // forward pass to leave its tail beyond the edge for the backward pass
+    job.ext = (int) ceilf(RECURSIVE_GAUSSIAN_EXT * sigma);
+
+    // q as given by Young and van Vliet (1995)
+    recursive_gaussian_coefs(sigma >= 2.5 ? 0.98711 * sigma - 0.96330 
+                             : 3.97156 - 4.14554 * sqrtf(1.0 - 0.26891 * sigma), &job);
+
+    size_t mark = scratch_mark();
+    atomic_init(&job.failed, 0);
+    job.buf = scratch_alloc(sizeof(float) * (size_t) job.inner_w * (job.inner_h + job.ext*2));
+    job.zeros = scratch_alloc(sizeof(float) * job.inner_w);
+    if (job.buf && job.zeros){
+        memset(job.zeros, 0, sizeof(float) * job.inner_w);
+        threadpool_run_bands(0, job.inner_h + job.ext*2, recursive_gaussian_rows, &job);
+        if (!atomic_load(&job.failed)){
+            threadpool_run_bands(0, job.inner_w, recursive_gaussian_cols, &job);
         }
     }
+    else { atomic_store(&job.failed, 1); }
+
+    scratch_reset(mark);
+    if (atomic_load(&job.failed)) {
+        fprintf(stderr, "\n%s\tFailed to allocate recursive gaussian buffer\n", WARN_TXT);
+        return 0;
+    }
+    return 1;
+}
+
+int filter_gaussian_recursive(struct image *img, float sigma){
+    return gaussian_recursive_into(img, img, sigma);
+}
+
+// Applies a gaussian blur to src, storing the result in dest (distinct from src)
+static int gaussian_into(struct image *dest, struct image *src, int size, float sigma){
+    // Large sigmas would be truncated by the kernel, so are applied recursively instead
+    if (sigma > GAUSSIAN_RECURSIVE_SIGMA) { return gaussian_recursive_into(dest, src, sigma); }
+
+    size_t mark = scratch_mark();
+    struct kernel *k = gaussian_kernel(processing_get_arena(), size, sigma);
+    int success = k && image_convolve_into(dest, src, k);
+    scratch_reset(mark);
+    return success;
+}
+
+
+int filter_gaussian(struct image *img, int size, float sigma){
+    // Large sigmas would be truncated by the kernel, so are applied recursively instead
+    if (sigma > GAUSSIAN_RECURSIVE_SIGMA) { return filter_gaussian_recursive(img, sigma); }
+
+    size_t mark = scratch_mark();
+    struct kernel *k = gaussian_kernel(processing_get_arena(), size, sigma);
+    if (!k) { scratch_reset(mark); return 0; }
 
     // Convolve the image with gaussian filter
-    if (!image_convolve(padded_img, k)){ 
+    if (!image_convolve(img, k)){ 
         fprintf(stderr, "\n%s\tFailed convolution. \n\t\tAborting\n", 
                 WARN_TXT); 
+        scratch_reset(mark);
         return 0;
     }
-    kernel_free(k);
-
-    // Free padded_img, if one was made
-    if (img != padded_img){
-        image_unpad_into(img, padded_img);
-        image_free(padded_img);
-    }
+    scratch_reset(mark);
 
     return 1;
 }
 
 
+struct threshold_job {
+    struct image *img;
+    unsigned char value;
+};
+
+// Thresholds the rows [y0, y1) of an image
+static void threshold_band(void *arg, int y0, int y1){
+    struct threshold_job *job = arg;
+    for (int y = y0; y < y1; ++y){
+        unsigned char *row = image_row(job->img, y);
+        for (int x = 0; x < job->img->width; ++x){ row[x] = row[x] < job->value ? 0 : 255; }
+    }
+}
+
 int filter_threshold(struct image *img, unsigned char value){
     if (!img->width || !img->height) { return 0; }
     if (img->channels != 1) { return 0; }
 
-    for (size_t i = 0; i < (size_t)(img->height*img->width); ++i){
-        img->data[i] = img->data[i] < value ? 0 : 255;
-    }
+    struct threshold_job job = { .img = img, .value = value };
+    threadpool_run_bands(0, img->height, threshold_band, &job);
 
     return 1;
 }
 
 
-int filter_hysteresis_threshold(struct image *img, unsigned char t1, unsigned char t2){
-    // Sanity checks
-    if (t1 <= t2) { return 0; }
-    if (!img->width || !img->height) { return 0; }
-    if (img->channels != 1) { return 0; }
-    
-    struct image *padded_img = img;
-    if (!img->padding){
-        if (!image_pad(padded_img, 1)){
-            fprintf(stderr, "%s\tFailed to pad image.\n\tAborting.\n", WARN_TXT);
-            return 0;
-        }
-    }
+// Masks are kept 1 bit per pixel, 8 pixels to a byte, with every row starting on a new byte
+#define MASK_ROW_SIZE(width) (((size_t)(width) + 7) / 8)
+
+static inline int mask_get(const unsigned char *row, size_t x){ 
+    return (row[x >> 3] >> (x & 7)) & 1; 
+}
+
+static inline void mask_set(unsigned char *row, size_t x){ 
+    row[x >> 3] |= (unsigned char)(1 << (x & 7)); 
+}
 
-    // Apply two separate thresholds and save them separately
-    size_t image_size = (size_t) (padded_img->width) * (size_t)(padded_img->height);
-    unsigned char t1_data[image_size], t2_data[image_size];
-    for (size_t i = 0; i < image_size; ++i){
-        t1_data[i] = padded_img->data[i] < t1 ? 0 : 255;
-        t2_data[i] = padded_img->data[i] < t2 ? 0 : 255;
+static inline void mask_clear(unsigned char *row, size_t x){ 
+    row[x >> 3] &= (unsigned char) ~(1 << (x & 7)); 
+}
+
+// Applies the hysteresis threshold to src by flooding, storing the result in dest
+static int hysteresis_flood(struct image *dest, struct image *src, 
+                            unsigned char t1, unsigned char t2){
+    int inner_w = src->width - src->padding*2, inner_h = src->height - src->padding*2;
+
+    // Split the pixels into strong (>= t1) and weak (>= t2 only) planes of 1 bit per pixel.
+    // The masks carry a frame of 1 (never set) so that neighbours beyond the edges need 
+    // no bounds checks
+    int mask_w = inner_w + 2, mask_h = inner_h + 2;
+    size_t mask_stride = MASK_ROW_SIZE(mask_w);
+    size_t mask_size = mask_stride * (size_t) mask_h;
+    size_t mark = scratch_mark();
+    unsigned char *strong = scratch_alloc(mask_size), *weak = scratch_alloc(mask_size);
+    if (!strong || !weak){
+        fprintf(stderr, "\n%s\tFailed to allocate hysteresis masks. \n\t\tAborting.\n", 
+                WARN_TXT); 
+        scratch_reset(mark);
+        return 0;
+    }
+    memset(strong, 0, mask_size);
+    memset(weak, 0, mask_size);
+    size_t weak_count = 0;
+    for (int y = 0; y < inner_h; ++y){
+        unsigned char *row = image_inner_row(src, y);
+        unsigned char *strong_row = &strong[(size_t)(y + 1) * mask_stride];
+        unsigned char *weak_row = &weak[(size_t)(y + 1) * mask_stride];
+        for (int x = 0; x < inner_w; ++x){
+            if (row[x] >= t1) { mask_set(strong_row, x + 1); }
+            else if (row[x] >= t2) { mask_set(weak_row, x + 1); weak_count++; }
+        }
     }
-    // find the rectangle of the inner image (without padding)
-    size_t top_left = padded_img->width * padded_img->padding + padded_img->padding;
-    size_t bottom_right = image_size - top_left;
     
-    const long moore_offsets[8] = {
-        -padded_img->width-1, -padded_img->width, -padded_img->width+1,
-                   -1,                         +1,
-         padded_img->width-1,  padded_img->width,  padded_img->width+1
+    // Apply edge rebuilding: each strong pixel floods through its 8-connected weak 
+    // neighbours, which turn strong (leaving the weak plane) as they are reached. Pixels are
+    // pushed only as they turn strong, so the stack never holds more than the weak pixels
+    // and each is visited once, however long or winding the edges are.
+    size_t *stack = scratch_alloc(sizeof(size_t) * (weak_count + 1));
+    if (!stack){
+        fprintf(stderr, "\n%s\tFailed to allocate hysteresis stack. \n\t\tAborting.\n", 
+                WARN_TXT); 
+        scratch_reset(mark);
+        return 0;
+    }
+    // Pixels are addressed by their bit in the planes
+    ptrdiff_t row_bits = (ptrdiff_t) mask_stride * 8;
+    ptrdiff_t neighbours[8] = { 
+        -row_bits - 1, -row_bits, -row_bits + 1, -1, 1, row_bits - 1, row_bits, row_bits + 1,
     };
-    
-    // Apply edge rebuilding
-    printf("%s\tStarting hysteresis threshold...\n", INFO_TXT);
-    size_t changed_pixels;
-    size_t total_changed = 0;
-    size_t step = 0;
-    do {
-        changed_pixels = 0;
-        for (size_t i = top_left; i < bottom_right; i++){
-            if (t1_data[i] || !t2_data[i]) { continue; }
-            if (!inner_image_contains(padded_img, i)) { continue; }
-            
-            for (size_t off_i = 0; off_i < 8; ++off_i){
-                size_t nbr_i = (size_t)((long) i + moore_offsets[off_i]);
-                if (t1_data[nbr_i]) {
-                    t1_data[i] = 255;
-                    changed_pixels++;
-                    break;
+    size_t recovered = 0;
+    for (int y = 1; y < mask_h - 1 && weak_count > recovered; ++y){
+        unsigned char *strong_row = &strong[(size_t) y * mask_stride];
+        for (int x = 1; x < mask_w - 1; ++x){
+            // Skip 8 pixels at a time where none are strong
+            if (!(x & 7) && !strong_row[x >> 3]) { x += 7; continue; }
+            if (!mask_get(strong_row, x)) { continue; }
+
+            size_t top = 0;
+            stack[top++] = (size_t) y * row_bits + x;
+            while (top){
+                size_t pixel = stack[--top];
+                for (int n = 0; n < 8; ++n){
+                    size_t next = pixel + neighbours[n];
+                    if (!mask_get(weak, next)) { continue; }
+                    mask_clear(weak, next);
+                    mask_set(strong, next);
+                    stack[top++] = next;
+                    recovered++;
                 }
             }
         }
-        step++;
-        total_changed += changed_pixels;
-    } while (changed_pixels);
-    printf("\t\tRecovered %lu pixels in %lu steps.\n", total_changed, step);
+    }
+    printf("\t\tRecovered %zu pixels.\n", recovered);
     
-    memcpy(padded_img->data, t1_data, image_size);
+    for (int y = 0; y < inner_h; ++y){
+        unsigned char *dest_row = image_inner_row(dest, y);
+        unsigned char *strong_row = &strong[(size_t)(y + 1) * mask_stride];
+        for (int x = 0; x < inner_w; ++x){ dest_row[x] = mask_get(strong_row, x + 1) ? 255 : 0; }
+    }
+
+    scratch_reset(mark);
+    return 1;
+}
 
-    // Free padded_img, if one was made
-    if (img != padded_img){
-        image_unpad_into(img, padded_img);
-        image_free(padded_img);
+// A run of pixels [x0, x1) in a row that pass the weaker threshold
+struct hysteresis_run {
+    int x0, x1;
+};
+
+// Bits of the flags kept per run
+#define RUN_STRONG 1    // The run holds a pixel passing the stronger threshold
+#define RUN_KEPT 2      // Set on the root run of every component holding a strong run
+
+// Arguments shared by the bands of a union-find hysteresis
+struct hysteresis_job {
+    struct image *dest, *src;
+    unsigned char t1, t2;
+    int inner_w;
+    size_t *row_first;              // The index of each row's first run, and the total last
+    struct hysteresis_run *runs;
+    _Atomic uint32_t *parent;       // The union-find forest over the runs
+    _Atomic unsigned char *flags;
+    _Atomic size_t recovered;
+};
+
+// Finds the root of run i, halving the path on the way
+static uint32_t run_find(_Atomic uint32_t *parent, uint32_t i){
+    uint32_t p;
+    while ((p = atomic_load_explicit(&parent[i], memory_order_relaxed)) != i){
+        // Skipping to the grandparent is safe whichever thread wins, as both are ancestors
+        uint32_t gp = atomic_load_explicit(&parent[p], memory_order_relaxed);
+        if (gp != p){
+            atomic_compare_exchange_weak_explicit(&parent[i], &p, gp, 
+                                                  memory_order_relaxed, memory_order_relaxed);
+        }
+        i = gp;
+    }
+    return i;
+}
+
+// Joins the components of runs a and b. Roots are only ever linked to a smaller root, and
+// only while they are still roots, so concurrent unions never form a cycle.
+static void run_union(_Atomic uint32_t *parent, uint32_t a, uint32_t b){
+    for (;;){
+        a = run_find(parent, a);
+        b = run_find(parent, b);
+        if (a == b) { return; }
+        if (a < b) { uint32_t t = a; a = b; b = t; }
+        uint32_t expected = a;
+        if (atomic_compare_exchange_weak_explicit(&parent[a], &expected, b, 
+                                                  memory_order_relaxed, memory_order_relaxed)){
+            return;
+        }
+    }
+}
+
+// Counts the runs of the rows [y0, y1), storing each row's count after its first index
+static void hysteresis_count_band(void *arg, int y0, int y1){
+    struct hysteresis_job *job = arg;
+    for (int y = y0; y < y1; ++y){
+        unsigned char *row = image_inner_row(job->src, y);
+        size_t count = 0;
+        for (int x = 0, in = 0; x < job->inner_w; ++x){
+            int pass = row[x] >= job->t2;
+            count += pass && !in;
+            in = pass;
+        }
+        job->row_first[y+1] = count;
+    }
+}
+
+// Stores the runs of the rows [y0, y1), each its own component
+static void hysteresis_runs_band(void *arg, int y0, int y1){
+    struct hysteresis_job *job = arg;
+    for (int y = y0; y < y1; ++y){
+        unsigned char *row = image_inner_row(job->src, y);
+        size_t i = job->row_first[y];
+        for (int x = 0; x < job->inner_w; ++x){
+            if (row[x] < job->t2) { continue; }
+            int x0 = x;
+            unsigned char strong = 0;
+            for (; x < job->inner_w && row[x] >= job->t2; ++x){ strong |= row[x] >= job->t1; }
+            job->runs[i] = (struct hysteresis_run) { x0, x };
+            atomic_init(&job->parent[i], (uint32_t) i);
+            atomic_init(&job->flags[i], strong ? RUN_STRONG : 0);
+            i++;
+        }
+    }
+}
+
+// Joins the runs of the rows [y0, y1) to the 8-connected runs of the row above each.
+// The first row's are joined across the band's border, concurrently with other bands.
+static void hysteresis_union_band(void *arg, int y0, int y1){
+    struct hysteresis_job *job = arg;
+    for (int y = MAX(y0, 1); y < y1; ++y){
+        size_t a = job->row_first[y-1], a_end = job->row_first[y];
+        size_t b = job->row_first[y], b_end = job->row_first[y+1];
+        // Walk both rows' runs in order, joining those that overlap or touch diagonally
+        while (a < a_end && b < b_end){
+            struct hysteresis_run *above = &job->runs[a], *run = &job->runs[b];
+            if (above->x0 <= run->x1 && run->x0 <= above->x1){
+                run_union(job->parent, (uint32_t) a, (uint32_t) b);
+            }
+            if (above->x1 < run->x1) { a++; }
+            else { b++; }
+        }
+    }
+}
+
+// Marks the components of the strong runs in the rows [y0, y1)
+static void hysteresis_mark_band(void *arg, int y0, int y1){
+    struct hysteresis_job *job = arg;
+    for (size_t i = job->row_first[y0]; i < job->row_first[y1]; ++i){
+        if (atomic_load_explicit(&job->flags[i], memory_order_relaxed) & RUN_STRONG){
+            atomic_fetch_or_explicit(&job->flags[run_find(job->parent, (uint32_t) i)], 
+                                     RUN_KEPT, memory_order_relaxed);
+        }
+    }
+}
+
+// Writes the rows [y0, y1) of the result, keeping the runs of marked components
+static void hysteresis_write_band(void *arg, int y0, int y1){
+    struct hysteresis_job *job = arg;
+    size_t recovered = 0;
+    for (int y = y0; y < y1; ++y){
+        unsigned char *src = image_inner_row(job->src, y), *dest = image_inner_row(job->dest, y);
+        int x = 0;
+        // Each run is read before it is written, as dest may be src
+        for (size_t i = job->row_first[y]; i < job->row_first[y+1]; ++i){
+            struct hysteresis_run *run = &job->runs[i];
+            memset(&dest[x], 0, run->x0 - x);
+            uint32_t root = run_find(job->parent, (uint32_t) i);
+            int kept = atomic_load_explicit(&job->flags[root], memory_order_relaxed) & RUN_KEPT;
+            if (kept){
+                for (int k = run->x0; k < run->x1; ++k){ recovered += src[k] < job->t1; }
+            }
+            memset(&dest[run->x0], kept ? 255 : 0, run->x1 - run->x0);
+            x = run->x1;
+        }
+        memset(&dest[x], 0, job->inner_w - x);
+    }
+    atomic_fetch_add_explicit(&job->recovered, recovered, memory_order_relaxed);
+}
+
+// Applies the hysteresis threshold to src as connected components, storing the result in
+// dest. Rows are split into runs of pixels passing t2, joined in a union-find forest, and
+// the components holding a pixel passing t1 are kept. Each step runs in parallel bands.
+// Returns -1 if there are too many runs to label.
+static int hysteresis_union_find(struct image *dest, struct image *src, 
+                                 unsigned char t1, unsigned char t2){
+    int inner_w = src->width - src->padding*2, inner_h = src->height - src->padding*2;
+    struct hysteresis_job job = { .dest = dest, .src = src, .t1 = t1, .t2 = t2, 
+                                  .inner_w = inner_w };
+    atomic_init(&job.recovered, 0);
+    size_t mark = scratch_mark();
+    size_t count = 0;
+    int allocated = (job.row_first = scratch_alloc(sizeof(size_t) * (inner_h + 1))) != NULL;
+    if (allocated){
+        job.row_first[0] = 0;
+        threadpool_run_bands(0, inner_h, hysteresis_count_band, &job);
+        for (int y = 0; y < inner_h; ++y){ job.row_first[y+1] += job.row_first[y]; }
+        if ((count = job.row_first[inner_h]) > UINT32_MAX) { scratch_reset(mark); return -1; }
+
+        job.runs = scratch_alloc(sizeof(struct hysteresis_run) * count);
+        job.parent = scratch_alloc(sizeof(_Atomic uint32_t) * count);
+        job.flags = scratch_alloc(sizeof(_Atomic unsigned char) * count);
+        allocated = !count || (job.runs && job.parent && job.flags);
+    }
+    if (!allocated){
+        fprintf(stderr, "\n%s\tFailed to allocate hysteresis runs. \n\t\tAborting.\n", 
+                WARN_TXT); 
+        scratch_reset(mark);
+        return 0;
+    }
+
+    threadpool_run_bands(0, inner_h, hysteresis_runs_band, &job);
+    threadpool_run_bands(0, inner_h, hysteresis_union_band, &job);
+    threadpool_run_bands(0, inner_h, hysteresis_mark_band, &job);
+    threadpool_run_bands(0, inner_h, hysteresis_write_band, &job);
+    printf("\t\tRecovered %zu pixels.\n", atomic_load(&job.recovered));
+
+    scratch_reset(mark);
+    return 1;
+}
+
+// A range of words [lo, hi) of a plane row left to update, empty when lo >= hi
+struct dilate_range {
+    size_t lo, hi;
+};
+
+// Arguments shared by the bands of a word parallel hysteresis. The planes hold 64 pixels to a
+// word, with a frame row (never set) above and below the image.
+struct dilate_job {
+    struct image *dest, *src;
+    unsigned char t1, t2;
+    int inner_w, inner_h;
+    size_t words;                   // The words per row
+    uint64_t *strong, *weak;        // Pixels >= t1, and those >= t2 only
+    struct dilate_range *dirty;     // The words of each plane row left to grow
+};
+
+// Allocates the planes of job for its image size, clearing their frame rows
+static int dilate_planes(struct dilate_job *job){
+    job->words = ((size_t) job->inner_w + 63) / 64;
+    size_t plane_size = sizeof(uint64_t) * job->words * (job->inner_h + 2);
+    job->strong = scratch_alloc(plane_size);
+    job->weak = scratch_alloc(plane_size);
+    job->dirty = scratch_alloc(sizeof(struct dilate_range) * (job->inner_h + 2));
+    if (!job->strong || !job->weak || !job->dirty){
+        fprintf(stderr, "\n%s\tFailed to allocate hysteresis planes. \n\t\tAborting.\n", 
+                WARN_TXT); 
+        return 0;
+    }
+    size_t row_size = sizeof(uint64_t) * job->words;
+    memset(job->strong, 0, row_size);
+    memset(job->weak, 0, row_size);
+    memset(&job->strong[(job->inner_h + 1) * job->words], 0, row_size);
+    memset(&job->weak[(job->inner_h + 1) * job->words], 0, row_size);
+    return 1;
+}
+
+// Thresholds (inner) row y of an image, `row`, into the planes
+static void dilate_threshold_row(struct dilate_job *job, int y, const unsigned char *row){
+    uint64_t *strong = &job->strong[(y + 1) * job->words];
+    uint64_t *weak = &job->weak[(y + 1) * job->words];
+    for (size_t i = 0; i < job->words; ++i){
+        const unsigned char *pixels = &row[i * 64];
+        int count = MIN(64, job->inner_w - (int) i * 64);
+        uint64_t strong_bits = 0, weak_bits = 0;
+        for (int b = 0; b < count; ++b){
+            strong_bits |= (uint64_t)(pixels[b] >= job->t1) << b;
+            weak_bits |= (uint64_t)(pixels[b] >= job->t2 && pixels[b] < job->t1) << b;
+        }
+        strong[i] = strong_bits;
+        weak[i] = weak_bits;
+    }
+}
+
+// Thresholds the rows [y0, y1) of the image into the planes
+static void dilate_threshold_band(void *arg, int y0, int y1){
+    struct dilate_job *job = arg;
+    for (int y = y0; y < y1; ++y){ dilate_threshold_row(job, y, image_inner_row(job->src, y)); }
+}
+
+// Writes the rows [y0, y1) of the result from the strong plane
+static void dilate_write_band(void *arg, int y0, int y1){
+    struct dilate_job *job = arg;
+    for (int y = y0; y < y1; ++y){
+        unsigned char *dest = image_inner_row(job->dest, y);
+        uint64_t *strong = &job->strong[(y + 1) * job->words];
+        for (int x = 0; x < job->inner_w; ++x){
+            dest[x] = (strong[x >> 6] >> (x & 63)) & 1 ? 255 : 0;
+        }
+    }
+}
+
+// The pixels of word i of a plane row with a strong 8-connected neighbour in the rows above
+// and below it (those beside it are reached by filling the row)
+static inline uint64_t dilate_vertical(struct dilate_job *job, uint64_t *above, 
+                                       uint64_t *below, size_t i){
+    uint64_t v = above[i] | below[i];
+    uint64_t result = v | v << 1 | v >> 1;
+    if (i) { result |= (above[i-1] | below[i-1]) >> 63; }
+    if (i + 1 < job->words) { result |= (above[i+1] | below[i+1]) << 63; }
+    return result;
+}
+
+// Grows the strong pixels of plane row r through its weak pixels, over the words [lo, hi)
+// and on past them while a run continues. Weak pixels beside a strong one above or below
+// seed the row, then every run of weak pixels holding a strong one is filled: towards the
+// high bits by adding the seeds (the carry ripples through the run), then back towards the
+// low bits with a logarithmic shift fill. Returns the range of words changed.
+static struct dilate_range dilate_row(struct dilate_job *job, int r, size_t lo, size_t hi, 
+                                      size_t *recovered){
+    size_t words = job->words;
+    uint64_t *strong = &job->strong[r * words], *weak = &job->weak[r * words];
+    uint64_t *above = strong - words, *below = strong + words;
+    struct dilate_range changed = { words, 0 };
+
+    uint64_t carry = 0;
+    size_t i = lo;
+    for (; i < words && (i < hi || (carry && (weak[i] & 1))); ++i){
+        uint64_t mask = strong[i] | weak[i];
+        uint64_t seeds = strong[i] | (dilate_vertical(job, above, below, i) & weak[i]) | 
+                         (carry & mask & 1);
+        uint64_t sum = mask + seeds;
+        uint64_t filled = ((sum ^ mask) | seeds) & mask;
+        carry = sum < mask;
+        uint64_t grown = filled & weak[i];
+        if (grown){
+            strong[i] |= grown;
+            weak[i] &= ~grown;
+            *recovered += __builtin_popcountll(grown);
+            changed.lo = MIN(changed.lo, i);
+            changed.hi = MAX(changed.hi, i + 1);
+        }
     }
 
+    carry = 0;
+    while (i-- > 0){
+        if (i < lo && !(carry && (weak[i] >> 63))) { break; }
+        uint64_t pro = strong[i] | weak[i], gen = strong[i] | ((carry << 63) & pro);
+        gen |= pro & (gen >> 1);  pro &= pro >> 1;
+        gen |= pro & (gen >> 2);  pro &= pro >> 2;
+        gen |= pro & (gen >> 4);  pro &= pro >> 4;
+        gen |= pro & (gen >> 8);  pro &= pro >> 8;
+        gen |= pro & (gen >> 16); pro &= pro >> 16;
+        gen |= pro & (gen >> 32);
+        uint64_t grown = gen & weak[i];
+        carry = gen & 1;
+        if (grown){
+            strong[i] |= grown;
+            weak[i] &= ~grown;
+            *recovered += __builtin_popcountll(grown);
+            changed.lo = MIN(changed.lo, i);
+            changed.hi = MAX(changed.hi, i + 1);
+        }
+    }
+    return changed;
+}
+
+// Grows the strong plane through the weak one until every connected weak pixel is strong.
+// Rows are grown in sweeps alternating down and up the image, so each sweep carries edges
+// as far as they run in its direction. Only the words beside those changed are revisited,
+// until a sweep changes nothing.
+static void dilate_grow(struct dilate_job *job){
+    int inner_h = job->inner_h;
+    struct dilate_range *dirty = job->dirty;
+
+    // Every row starts dirty, the frame rows never are
+    for (int r = 0; r < inner_h + 2; ++r){ 
+        dirty[r] = (struct dilate_range) { 0, r && r <= inner_h ? job->words : 0 }; 
+    }
+    size_t recovered = 0, sweeps = 0;
+    int changed;
+    do {
+        changed = 0;
+        int down = !(sweeps++ & 1);
+        for (int n = 1; n <= inner_h; ++n){
+            int r = down ? n : inner_h + 1 - n;
+            struct dilate_range range = dirty[r];
+            if (range.lo >= range.hi) { continue; }
+            dirty[r] = (struct dilate_range) { 0, 0 };
+
+            struct dilate_range grown = dilate_row(job, r, range.lo, range.hi, &recovered);
+            if (grown.lo >= grown.hi) { continue; }
+            changed = 1;
+            // The neighbours of the grown pixels, a word either side, need another look
+            grown.lo = grown.lo ? grown.lo - 1 : 0;
+            grown.hi = MIN(grown.hi + 1, job->words);
+            for (int d = -1; d <= 1; d += 2){
+                struct dilate_range *next = &dirty[r + d];
+                if (r + d < 1 || r + d > inner_h) { continue; }
+                if (next->lo >= next->hi) { *next = grown; }
+                else { next->lo = MIN(next->lo, grown.lo); next->hi = MAX(next->hi, grown.hi); }
+            }
+        }
+    } while (changed);
+    printf("\t\tRecovered %zu pixels in %zu sweeps.\n", recovered, sweeps);
+}
+
+// Applies the hysteresis threshold to src by word parallel dilation, storing the result in
+// dest
+static int hysteresis_dilate(struct image *dest, struct image *src, 
+                             unsigned char t1, unsigned char t2){
+    struct dilate_job job = { .dest = dest, .src = src, .t1 = t1, .t2 = t2, 
+                              .inner_w = src->width - src->padding*2, 
+                              .inner_h = src->height - src->padding*2 };
+    size_t mark = scratch_mark();
+    if (!dilate_planes(&job)) { scratch_reset(mark); return 0; }
+    threadpool_run_bands(0, job.inner_h, dilate_threshold_band, &job);
+    dilate_grow(&job);
+    threadpool_run_bands(0, job.inner_h, dilate_write_band, &job);
+    scratch_reset(mark);
     return 1;
 }
 
+// Applies the hysteresis threshold to src, storing the result in dest (which may be src),
+// with the algorithm set through processing_set_hysteresis().
+// Thresholds with t1 <= t2 are invalid and leave src unthresholded.
+static int hysteresis_into(struct image *dest, struct image *src, 
+                           unsigned char t1, unsigned char t2){
+    int inner_w = src->width - src->padding*2, inner_h = src->height - src->padding*2;
+    if (t1 <= t2){
+        for (int y = 0; y < inner_h && dest != src; ++y){
+            memcpy(image_inner_row(dest, y), image_inner_row(src, y), inner_w);
+        }
+        return 1;
+    }
+
+    printf("%s\tStarting hysteresis threshold...\n", INFO_TXT);
+    if (hysteresis_mode == HYSTERESIS_UNION_FIND){
+        int result = hysteresis_union_find(dest, src, t1, t2);
+        if (result >= 0) { return result; }
+        fprintf(stderr, "%s\tToo many runs for union-find hysteresis.\n"
+                "\t\tFlooding instead.\n", WARN_TXT);
+    }
+    if (hysteresis_mode == HYSTERESIS_DILATE) { return hysteresis_dilate(dest, src, t1, t2); }
+    return hysteresis_flood(dest, src, t1, t2);
+}
+
+int filter_hysteresis_threshold(struct image *img, unsigned char t1, unsigned char t2){
+    // Sanity checks
+    if (t1 <= t2) { return 0; }
+    if (!img->width || !img->height) { return 0; }
+    if (img->channels != 1) { return 0; }
+
+    return hysteresis_into(img, img, t1, t2);
+}
+
 
 int filter_cross(struct image *img){
     static float kx_vals[2][2] = {
@@ -503,26 +2139,389 @@ int filter_cross(struct image *img){
     if (img->channels != 1) { return 0; }
     if (!img->width || !img->height) { return 0; }
     
-    struct kernel *kx = kernel_create(2, 2, 1.0, kx_vals);
-    struct kernel *ky = kernel_create(2, 2, 1.0, ky_vals);
-    if (!kx || !ky) { return 0; }
+    size_t mark = scratch_mark();
+    struct kernel *kx = scratch_kernel(2, 2, 1.0, kx_vals);
+    struct kernel *ky = scratch_kernel(2, 2, 1.0, ky_vals);
+    if (!kx || !ky) { scratch_reset(mark); return 0; }
 
     filter_two_pass(img, kx, ky, 0);
 
-    kernel_free(kx); 
-    kernel_free(ky);
+    scratch_reset(mark);
     return 1;
 }
 
 
-int filter_canny(struct image *img, float sigma, unsigned char t1, unsigned char t2){
+// The size of the gaussian kernel Canny blurs with (below GAUSSIAN_RECURSIVE_SIGMA)
+#define CANNY_BLUR_SIZE 5
+
+// Arguments for the stages of Canny
+struct canny_job {
+    struct kernel *kx, *ky;
+    float sigma;
+    unsigned char t1, t2;
+    struct gradient_histogram *histogram;   // Chooses t1 and t2 when set, counting the
+                                            // magnitude of every row of the image
+};
+
+// Applies the stages of Canny up to thinning to src, ping-ponging between it and buf.
+// The rows [y0, y1) of src are counted into the histogram, if there is one.
+// Returns the image holding the thinned magnitude, NULL on failure.
+static struct image *canny_stages(struct image *src, struct image *buf, int y0, int y1, 
+                                  void *arg){
+    struct canny_job *job = arg;
+    if (job->histogram) { job->histogram->y0 = y0; job->histogram->y1 = y1; }
+    if (job->sigma > 0.0){
+        // blur (src -> buf), magnitude (buf -> src), thinning (src -> buf)
+        mem_stats_push("blur");
+        int success = gaussian_into(buf, src, CANNY_BLUR_SIZE, job->sigma);
+        mem_stats_pop();
+        mem_stats_push("gradient");
+        success = success && two_pass_into(buf, buf, job->kx, job->ky, 1, src, job->histogram);
+        mem_stats_pop();
+        return success ? buf : NULL;
+    }
+    // Without a blur, the gradients are taken from src directly
+    mem_stats_push("gradient");
+    int success = two_pass_into(src, src, job->kx, job->ky, 1, buf, job->histogram);
+    mem_stats_pop();
+    return success ? src : NULL;
+}
+
+// Chooses the thresholds of Canny from the histogram of gradient magnitude. The stricter is
+// found by Otsu's method, splitting the magnitudes where the variance between the two sides
+// is greatest (edges from the flat regions around them), and the softer is half of it.
+// Flat pixels are left out, as on images mostly flat they would split off alone, and the
+// thresholds are kept from reaching 0, which would keep every pixel.
+static void canny_thresholds(struct canny_job *job){
+    double total = 0.0, sum = 0.0;
+    for (int i = 1; i < GRADIENT_HISTOGRAM_BINS; ++i){
+        double count = (double) atomic_load(&job->histogram->bins[i]);
+        total += count;
+        sum += count * i;
+    }
+
+    // Magnitudes up to `split` fall below the threshold, and those above it reach it
+    double below = 0.0, below_sum = 0.0, best = -1.0;
+    int split = 0;
+    for (int i = 1; i < GRADIENT_HISTOGRAM_BINS - 1; ++i){
+        double count = (double) atomic_load(&job->histogram->bins[i]);
+        below += count;
+        below_sum += count * i;
+        double above = total - below;
+        if (below == 0.0) { continue; }
+        if (above == 0.0) { break; }
+        double diff = below_sum / below - (sum - below_sum) / above;
+        double variance = below * above * diff * diff;
+        if (variance > best) { best = variance; split = i; }
+    }
+    job->t1 = (unsigned char) MAX(split + 1, 2);
+    job->t2 = (unsigned char) MAX(job->t1 / 2, 1);
+}
+
+/*
+ * Streaming Canny, for blurs applied with a kernel.
+ *
+ * Rows are pushed through the blur, the gradient and thinning one at a time, each stage
+ * keeping only the rows the next reads in a ring: the horizontally filtered source rows
+ * under the blur, the blurred rows under the Sobel kernels, and the magnitudes and
+ * directions compared by thinning. Thinned rows are thresholded straight into the planes of
+ * the hysteresis, the only state held for the whole image, which is written once they are
+ * grown. Each band of rows streams on its own, first filling its rings from the rows above
+ * it. The arithmetic of every stage is shared with the whole image passes, so the result
+ * is identical to theirs.
+ */
+
+// The rows of the Sobel kernels, which the gradient and thinning each read around a row
+#define CANNY_STREAM_ROWS 3
+
+// Arguments shared by the bands of a streaming Canny
+struct canny_stream {
+    struct convolve_job blur;       // The blur of the source, its kernel NULL without one
+    struct gradient_job gradient;
+    struct dilate_job planes;
+    struct image *thinned;          // Receives the thinned magnitude when choosing the
+                                    // thresholds or not dilating, in place of the planes
+};
+
+// The rings of a band, and its rows besides
+struct canny_stream_rings {
+    float *hpass;               // The horizontally filtered source rows under the blur
+    unsigned char *blurred;     // The blurred rows under the Sobel kernels, then the last
+                                // and first rows of the image for a wrapping border
+    unsigned char *mag;         // The magnitude of the rows compared by thinning
+    unsigned char *dirs;        // The directions of the row being thinned and the next
+    unsigned char *thinned;
+};
+
+// Blurs (inner) row y into dest, filtering the source row entering the window first (or
+// the whole window when `fill` is set)
+static void canny_stream_blur(struct canny_stream *stream, struct canny_stream_rings *rings,
+                              int y, int fill, unsigned char *dest){
+    struct convolve_job *job = &stream->blur;
+    int half = CANNY_BLUR_SIZE/2;
+    for (int sy = fill ? y - half : y + half; sy <= y + half; ++sy){
+        float *row = &rings->hpass[(size_t) gradient_ring_slot(sy, CANNY_BLUR_SIZE) * job->inner_w];
+        unsigned char *src = convolve_source_row(job, sy);
+        if (src) { convolve_hpass_row(job, row, src, 0, job->inner_w); }
+        else { memset(row, 0, sizeof(float) * job->inner_w); }
+    }
+
+    float *rows[CANNY_BLUR_SIZE];
+    for (int ky = 0; ky < CANNY_BLUR_SIZE; ++ky){
+        int slot = gradient_ring_slot(y - half + ky, CANNY_BLUR_SIZE);
+        rows[ky] = &rings->hpass[(size_t) slot * job->inner_w];
+    }
+    job->vpass(dest, rows, job->k, job->inner_w);
+}
+
+// Returns the blurred row read by kernel row ky for the gradient of (inner) row y,
+// NULL if black
+static unsigned char *canny_stream_blurred(struct canny_stream *stream, 
+                                           struct canny_stream_rings *rings, int y, int ky){
+    struct gradient_job *job = &stream->gradient;
+    int src_y = border_index(y + ky - CANNY_STREAM_ROWS/2, job->inner_h, job->border);
+    if (src_y < 0) { return NULL; }
+    if (!stream->blur.k) { return image_inner_row(job->src, src_y); }
+
+    // Only a wrapping border reaches beyond the window, for the first or last row
+    int slot = gradient_ring_slot(src_y, CANNY_STREAM_ROWS);
+    if (src_y < y - 1 || src_y > y + 1){
+        slot = src_y ? CANNY_STREAM_ROWS : CANNY_STREAM_ROWS + 1;
+    }
+    return &rings->blurred[(size_t) slot * job->inner_w];
+}
+
+// Streams the (inner) rows [y0, y1) through Canny up to the hysteresis planes
+static void canny_stream_band(void *arg, int y0, int y1){
+    struct canny_stream *stream = arg;
+    struct gradient_job *job = &stream->gradient;
+    gradient_fused_fn fused = gradient_fused_select(job->kx, job->ky);
+    int inner_w = job->inner_w, inner_h = job->inner_h;
+    size_t dir_size = DIR_ROW_SIZE(inner_w);
+
+    struct canny_stream_rings rings = {
+        .hpass = stream->blur.k ? scratch_alloc(sizeof(float) * inner_w * CANNY_BLUR_SIZE) 
+                                : NULL,
+        .blurred = stream->blur.k ? scratch_alloc((size_t) inner_w * (CANNY_STREAM_ROWS + 2)) 
+                                  : NULL,
+        .mag = scratch_alloc((size_t) inner_w * CANNY_STREAM_ROWS),
+        .dirs = scratch_alloc(dir_size * 2),
+        .thinned = scratch_alloc(inner_w),
+    };
+    if ((stream->blur.k && (!rings.hpass || !rings.blurred)) || 
+        !rings.mag || !rings.dirs || !rings.thinned){ 
+        atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
+        return; 
+    }
+
+    // A wrapping border joins the first and last rows, blurred ahead of the rest
+    if (stream->blur.k && job->border == BORDER_WRAP){
+        unsigned char *edges = &rings.blurred[(size_t) inner_w * CANNY_STREAM_ROWS];
+        if (y0 <= 1) { canny_stream_blur(stream, &rings, inner_h - 1, 1, edges); }
+        if (y1 >= inner_h - 1) { canny_stream_blur(stream, &rings, 0, 1, &edges[inner_w]); }
+    }
+
+    // Each step blurs row y, takes the gradient of the row above it and thins the row above
+    // that, each reading the rows around it from the stage before
+    int fill = 1;
+    size_t counts[GRADIENT_HISTOGRAM_BINS] = {0};
+    for (int y = y0 - 2; y <= y1 + 1; ++y){
+        if (stream->blur.k && y >= 0 && y < inner_h){
+            int slot = gradient_ring_slot(y, CANNY_STREAM_ROWS);
+            canny_stream_blur(stream, &rings, y, fill, &rings.blurred[(size_t) slot * inner_w]);
+            fill = 0;
+        }
+
+        int g = y - 1;
+        if (g >= MAX(y0 - 1, 0) && g < MIN(y1 + 1, inner_h)){
+            unsigned char *src_rows[CANNY_STREAM_ROWS];
+            for (int ky = 0; ky < CANNY_STREAM_ROWS; ++ky){
+                src_rows[ky] = canny_stream_blurred(stream, &rings, g, ky);
+            }
+            int slot = gradient_ring_slot(g, CANNY_STREAM_ROWS);
+            gradient_fused_row(job, fused, src_rows, &rings.mag[(size_t) slot * inner_w],
+                               &rings.dirs[(size_t)(g & 1) * dir_size]);
+            gradient_histogram_row(job, counts, g, &rings.mag[(size_t) slot * inner_w]);
+        }
+
+        int n = y - 2;
+        if (n >= y0 && n < y1){
+            unsigned char *mag[CANNY_STREAM_ROWS];
+            for (int ky = 0; ky < CANNY_STREAM_ROWS; ++ky){
+                int slot = gradient_ring_slot(n + ky - 1, CANNY_STREAM_ROWS);
+                mag[ky] = &rings.mag[(size_t) slot * inner_w];
+            }
+            unsigned char *thinned = stream->thinned ? image_inner_row(stream->thinned, n) 
+                                                     : rings.thinned;
+            nms_row(thinned, n > 0 ? mag[0] : NULL, mag[1], 
+                    n < inner_h - 1 ? mag[2] : NULL, &rings.dirs[(size_t)(n & 1) * dir_size], 
+                    inner_w);
+            if (!stream->thinned) { dilate_threshold_row(&stream->planes, n, thinned); }
+        }
+    }
+    gradient_histogram_merge(job, counts);
+}
+
+// Prints the thresholds chosen from the histogram
+static void canny_thresholds_print(struct canny_job *job){
+    printf("%s\tChose thresholds %u and %u by Otsu's method.\n", INFO_TXT, job->t1, job->t2);
+}
+
+// Applies Canny to img as a stream of rows, blurring with a kernel for the given sigma
+// (0 for none). Given thresholds with t1 <= t2 are not supported.
+// When choosing the thresholds, the thinned magnitude of the whole image is kept for the
+// hysteresis in place of its planes, as they cannot be filled before the last row. So it
+// is for hysteresis modes other than HYSTERESIS_DILATE, which work from the magnitude.
+static int canny_stream(struct image *img, struct canny_job *canny){
+    int inner_w = img->width - img->padding*2, inner_h = img->height - img->padding*2;
+    int frac_bits = MIN(gradient_frac_bits(canny->kx), gradient_frac_bits(canny->ky));
+    struct canny_stream stream = {
+        .blur = {
+            .src = img, .inner_w = inner_w, .inner_h = inner_h, .border = border_mode,
+            .hpass = convolve_hpass_5, .vpass = convolve_vpass_5,
+        },
+        .gradient = {
+            .src = img, .kx = canny->kx, .ky = canny->ky,
+            .scale_x = (1 << frac_bits) / canny->kx->divisor, 
+            .scale_y = (1 << frac_bits) / canny->ky->divisor,
+            .frac_bits = frac_bits, .norm = gradient_norm, .histogram = canny->histogram,
+            .inner_w = inner_w, .inner_h = inner_h, .border = border_mode,
+        },
+        .planes = { 
+            .dest = img, .t1 = canny->t1, .t2 = canny->t2, 
+            .inner_w = inner_w, .inner_h = inner_h,
+        },
+    };
+
+    // The rings and the state held for the hysteresis are accounted to the stream
+    size_t mark = scratch_mark();
+    mem_stats_push("stream");
+    if (canny->sigma > 0.0){
+        stream.blur.k = gaussian_kernel(processing_get_arena(), CANNY_BLUR_SIZE, canny->sigma);
+    }
+    int kx_w = canny->kx->width;
+    stream.gradient.zeros = scratch_alloc(inner_w + kx_w);
+    int keep_thinned = canny->histogram || hysteresis_mode != HYSTERESIS_DILATE;
+    int held = keep_thinned ? (stream.thinned = scratch_image(img)) != NULL 
+                            : dilate_planes(&stream.planes);
+    if ((canny->sigma > 0.0 && !stream.blur.k) || !stream.gradient.zeros || !held){
+        if (!held && keep_thinned){
+            fprintf(stderr, "\n%s\tFailed to allocate images. \n\t\tAborting Canny.\n", 
+                    WARN_TXT);
+        }
+        mem_stats_pop();
+        scratch_reset(mark);
+        return 0;
+    }
+    memset(stream.gradient.zeros, 0, inner_w + kx_w);
+    atomic_init(&stream.gradient.failed, 0);
+
+    threadpool_run_bands(0, inner_h, canny_stream_band, &stream);
+    mem_stats_pop();
+    if (atomic_load(&stream.gradient.failed)){
+        fprintf(stderr, "\n%s\tFailed to allocate Canny rings. \n\t\tAborting.\n", WARN_TXT);
+        scratch_reset(mark);
+        return 0;
+    }
+
+    // The source has been read entirely, so the result is written over it
+    int success = 1;
+    mem_stats_push("hysteresis");
+    if (stream.thinned){
+        if (canny->histogram){
+            canny_thresholds(canny);
+            canny_thresholds_print(canny);
+        }
+        success = hysteresis_into(img, stream.thinned, canny->t1, canny->t2);
+    }
+    else {
+        printf("%s\tStarting hysteresis threshold...\n", INFO_TXT);
+        dilate_grow(&stream.planes);
+        threadpool_run_bands(0, inner_h, dilate_write_band, &stream.planes);
+    }
+    mem_stats_pop();
+
+    scratch_reset(mark);
+    return success;
+}
+
+// Applies Canny to img as set out by job, whose kernels are yet to be created
+static int canny_apply(struct image *img, struct canny_job *job){
     if (!img->width || !img->height) { return 0; }
     if (img->channels != 1) { return 0; }
-    if (sigma < 0.0) { return 0; }
+    if (job->sigma < 0.0) { return 0; }
+
+    size_t mark = scratch_mark();
+    float sigma = job->sigma;
+    if (!kernels_sobel(&job->kx, &job->ky)) { scratch_reset(mark); return 0; }
+    if (job->histogram){
+        job->histogram->bins = scratch_alloc(sizeof(atomic_size_t) * GRADIENT_HISTOGRAM_BINS);
+        if (!job->histogram->bins) { scratch_reset(mark); return 0; }
+        for (int i = 0; i < GRADIENT_HISTOGRAM_BINS; ++i){ 
+            atomic_init(&job->histogram->bins[i], 0); 
+        }
+        job->histogram->y0 = 0;
+        job->histogram->y1 = img->height - img->padding*2;
+    }
+
+    // Blurs applied with a kernel stream through every stage, in a few rows of memory
+    if (sigma <= GAUSSIAN_RECURSIVE_SIGMA && (job->t1 > job->t2 || job->histogram)){
+        int success = canny_stream(img, job);
+        scratch_reset(mark);
+        return success;
+    }
+
+    // Under a memory budget, large images are processed in strips. Their halo covers the
+    // rows read by the blur and the gradients.
+    int inner_w = img->width - img->padding*2, inner_h = img->height - img->padding*2;
+    size_t stride = image_stride(inner_w, 1);
+    size_t cost = gradient_row_cost(job->kx, job->ky, 1, inner_w);
+    int halo = gradient_halo(job->kx, job->ky, 1) + (sigma > 0.0 ? CANNY_BLUR_SIZE/2 : 0);
+    int rows = 0;
+    if (sigma <= GAUSSIAN_RECURSIVE_SIGMA){
+        rows = strip_rows(img, halo, stride*2 + cost, stride + cost, 0);
+    }
+    else if (max_memory && 
+             (size_t) inner_h * (stride + cost + sizeof(float) * inner_w) > max_memory){
+        // The recursive blur's response never ends, so no halo would make strips exact
+        fprintf(stderr, "%s\tRecursive blurs cannot be split into strips.\n"
+                "\t\tIgnoring the memory budget.\n", WARN_TXT);
+    }
+
+    // Edges connect across strips, so hysteresis runs on the whole thinned image
+    struct image *buf = NULL, *thinned = NULL;
+    if (rows) { thinned = strip_apply(img, rows, halo, canny_stages, job) ? img : NULL; }
+    else {
+        // Every stage ping-pongs between img and an intermediate image, allocated once
+        if (!(buf = scratch_image(img))){
+            fprintf(stderr, "\n%s\tFailed to allocate images. \n\t\tAborting Canny.\n", 
+                    WARN_TXT);
+        }
+        else { thinned = canny_stages(img, buf, 0, img->height - img->padding*2, job); }
+    }
+
+    int success = 0;
+    if (thinned){
+        mem_stats_push("hysteresis");
+        if (job->histogram) { canny_thresholds(job); canny_thresholds_print(job); }
+        success = hysteresis_into(img, thinned, job->t1, job->t2);
+        mem_stats_pop();
+    }
 
-    filter_gaussian(img, 5, sigma);
-    filter_sobel(img, 1);
-    filter_hysteresis_threshold(img, t1, t2);
+    scratch_reset(mark);
+    return success;
+}
+
+int filter_canny(struct image *img, float sigma, unsigned char t1, unsigned char t2){
+    struct canny_job job = { .sigma = sigma, .t1 = t1, .t2 = t2 };
+    return canny_apply(img, &job);
+}
 
+int filter_canny_auto(struct image *img, float sigma, unsigned char *t1, unsigned char *t2){
+    struct gradient_histogram histogram;
+    struct canny_job job = { .sigma = sigma, .histogram = &histogram };
+    if (!canny_apply(img, &job)) { return 0; }
+    if (t1) { *t1 = job.t1; }
+    if (t2) { *t2 = job.t2; }
     return 1;
 }
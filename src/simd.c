@@ -0,0 +1,350 @@
+#include "../include/simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+typedef int (*convolve_row_fn)(unsigned char *, unsigned char **, struct kernel *, int);
+
+static int convolve_row_none(unsigned char *dest, unsigned char *rows[3],
+                             struct kernel *k, int count);
+#ifdef SIMD_X86
+static int convolve_row_3x3_sse41(unsigned char *dest, unsigned char *rows[3],
+                                  struct kernel *k, int count);
+static int convolve_row_3x3_int_sse41(unsigned char *dest, unsigned char *rows[3],
+                                      struct kernel *k, int count);
+static int convolve_row_3x3_avx2(unsigned char *dest, unsigned char *rows[3],
+                                 struct kernel *k, int count);
+static int convolve_row_3x3_int_avx2(unsigned char *dest, unsigned char *rows[3],
+                                     struct kernel *k, int count);
+#endif
+
+static enum simd_level detected_level = SIMD_NONE;
+static enum simd_level active_level = SIMD_NONE;
+static convolve_row_fn convolve_row_3x3 = convolve_row_none;
+static convolve_row_fn convolve_row_3x3_int = convolve_row_none;
+
+// Query the CPU once at startup and select the widest supported routines
+__attribute__((constructor))
+static void simd_init(void){
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) { detected_level = SIMD_AVX2; }
+    else if (__builtin_cpu_supports("sse4.1")) { detected_level = SIMD_SSE41; }
+#endif
+    simd_set_level(detected_level);
+}
+
+enum simd_level simd_get_level(void){ return active_level; }
+
+enum simd_level simd_set_level(enum simd_level level){
+    active_level = MIN(level, detected_level);
+    switch (active_level){
+#ifdef SIMD_X86
+        case SIMD_AVX2:
+            convolve_row_3x3 = convolve_row_3x3_avx2;
+            convolve_row_3x3_int = convolve_row_3x3_int_avx2;
+            break;
+        case SIMD_SSE41:
+            convolve_row_3x3 = convolve_row_3x3_sse41;
+            convolve_row_3x3_int = convolve_row_3x3_int_sse41;
+            break;
+#endif
+        default:
+            convolve_row_3x3 = convolve_row_none;
+            convolve_row_3x3_int = convolve_row_none;
+            break;
+    }
+    return active_level;
+}
+
+int simd_convolve_row_3x3(unsigned char *dest, unsigned char *rows[3],
+                          struct kernel *k, int count){
+    return convolve_row_3x3(dest, rows, k, count);
+}
+
+int simd_convolve_row_3x3_int(unsigned char *dest, unsigned char *rows[3],
+                              struct kernel *k, int count){
+    if (!k->div_mul) { return 0; }
+    return convolve_row_3x3_int(dest, rows, k, count);
+}
+
+
+static int convolve_row_none(unsigned char *dest, unsigned char *rows[3],
+                             struct kernel *k, int count){
+    (void) dest; (void) rows; (void) k; (void) count;
+    return 0;
+}
+
+
+#ifdef SIMD_X86
+/*
+ * The float routines mirror the scalar convolution exactly: products are summed in
+ * the same (row-major) order without fused multiply-adds, divided by the divisor and
+ * rounded half away from zero like roundf(), then clamped to a byte.
+ *
+ * The integer routines mirror kernel_int_result(): the sum is clamped to
+ * [d, 512d - 1] after computing 2*sum + d, then divided by 2d through div_mul.
+ *
+ * Loads are unaligned throughout. Rows start on a cache line, but each tap reads from
+ * x + kx - 1 and views start at any column, so no load can be relied on to be aligned;
+ * an unaligned load of an aligned address costs nothing extra on current x86.
+ */
+
+// Sums of integer kernels fit in 16 bit lanes when every partial sum is below 2^15
+#define FITS_INT16(k) (255 * (k)->abs_sum <= 32767)
+
+__attribute__((target("sse4.1")))
+static inline __m128 roundf_sse41(__m128 v){
+    const __m128 sign_mask = _mm_set1_ps(-0.0f);
+    __m128 trunc = _mm_round_ps(v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    // v - trunc(v) is exact, so comparing it against 0.5 matches roundf()
+    __m128 frac = _mm_andnot_ps(sign_mask, _mm_sub_ps(v, trunc));
+    __m128 step = _mm_or_ps(_mm_set1_ps(1.0f), _mm_and_ps(sign_mask, v));
+    __m128 away = _mm_cmpge_ps(frac, _mm_set1_ps(0.5f));
+    return _mm_add_ps(trunc, _mm_and_ps(away, step));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i load_4_sse41(unsigned char *src){
+    int bytes;
+    memcpy(&bytes, src, sizeof(int));
+    return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i convolve_4_sse41(unsigned char *rows[3], int x,
+                                       __m128 kv[3][3], __m128 div){
+    __m128 cell = _mm_setzero_ps();
+    for (int ky = 0; ky < 3; ++ky){
+        for (int kx = 0; kx < 3; ++kx){
+            __m128 px = _mm_cvtepi32_ps(load_4_sse41(&rows[ky][x+kx]));
+            cell = _mm_add_ps(cell, _mm_mul_ps(kv[ky][kx], px));
+        }
+    }
+    cell = roundf_sse41(_mm_div_ps(cell, div));
+    cell = _mm_min_ps(_mm_max_ps(cell, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    return _mm_cvttps_epi32(cell);
+}
+
+__attribute__((target("sse4.1")))
+static int convolve_row_3x3_sse41(unsigned char *dest, unsigned char *rows[3],
+                                  struct kernel *k, int count){
+    __m128 kv[3][3];
+    for (int ky = 0; ky < 3; ++ky){
+        for (int kx = 0; kx < 3; ++kx){ kv[ky][kx] = _mm_set1_ps(k->values[ky][kx]); }
+    }
+    __m128 div = _mm_set1_ps(k->divisor);
+
+    int x = 0;
+    for (; x < count; x += 16){
+        // A partial last block is shifted back to end at count, recomputing a few pixels
+        if (x + 16 > count){
+            if (count < 16) { break; }
+            x = count - 16;
+        }
+        __m128i a = convolve_4_sse41(rows, x, kv, div);
+        __m128i b = convolve_4_sse41(rows, x+4, kv, div);
+        __m128i c = convolve_4_sse41(rows, x+8, kv, div);
+        __m128i d = convolve_4_sse41(rows, x+12, kv, div);
+        __m128i packed = _mm_packus_epi16(_mm_packus_epi32(a, b), _mm_packus_epi32(c, d));
+        _mm_storeu_si128((__m128i *) &dest[x], packed);
+    }
+    return x;
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i int_result_sse41(__m128i sum, __m128i d, __m128i n_max, __m128i mul){
+    __m128i n = _mm_add_epi32(_mm_add_epi32(sum, sum), d);
+    n = _mm_min_epi32(_mm_max_epi32(n, d), n_max);
+    return _mm_srli_epi32(_mm_mullo_epi32(n, mul), KERNEL_DIV_SHIFT);
+}
+
+__attribute__((target("sse4.1")))
+static int convolve_row_3x3_int_sse41(unsigned char *dest, unsigned char *rows[3],
+                                      struct kernel *k, int count){
+    __m128i d = _mm_set1_epi32(k->idivisor);
+    __m128i n_max = _mm_set1_epi32(512 * k->idivisor - 1);
+    __m128i mul = _mm_set1_epi32((int) k->div_mul);
+    int narrow = FITS_INT16(k);
+
+    __m128i kv[3][3];
+    for (int ky = 0; ky < 3; ++ky){
+        for (int kx = 0; kx < 3; ++kx){
+            int val = k->ivalues[ky*3 + kx];
+            kv[ky][kx] = narrow ? _mm_set1_epi16((short) val) : _mm_set1_epi32(val);
+        }
+    }
+
+    int x = 0;
+    for (; x < count; x += 16){
+        // A partial last block is shifted back to end at count, recomputing a few pixels
+        if (x + 16 > count){
+            if (count < 16) { break; }
+            x = count - 16;
+        }
+        __m128i sums[4];
+        if (narrow){
+            // 8 pixels per 16 bit lane vector, widened only to divide
+            for (int half = 0; half < 2; ++half){
+                __m128i acc = _mm_setzero_si128();
+                for (int ky = 0; ky < 3; ++ky){
+                    for (int kx = 0; kx < 3; ++kx){
+                        __m128i bytes = _mm_loadl_epi64((__m128i *) &rows[ky][x + half*8 + kx]);
+                        __m128i px = _mm_cvtepu8_epi16(bytes);
+                        acc = _mm_add_epi16(acc, _mm_mullo_epi16(px, kv[ky][kx]));
+                    }
+                }
+                sums[half*2] = _mm_cvtepi16_epi32(acc);
+                sums[half*2 + 1] = _mm_cvtepi16_epi32(_mm_srli_si128(acc, 8));
+            }
+        }
+        else {
+            for (int quarter = 0; quarter < 4; ++quarter){
+                __m128i acc = _mm_setzero_si128();
+                for (int ky = 0; ky < 3; ++ky){
+                    for (int kx = 0; kx < 3; ++kx){
+                        __m128i px = load_4_sse41(&rows[ky][x + quarter*4 + kx]);
+                        acc = _mm_add_epi32(acc, _mm_mullo_epi32(px, kv[ky][kx]));
+                    }
+                }
+                sums[quarter] = acc;
+            }
+        }
+
+        for (int i = 0; i < 4; ++i){ sums[i] = int_result_sse41(sums[i], d, n_max, mul); }
+        __m128i packed = _mm_packus_epi16(_mm_packus_epi32(sums[0], sums[1]),
+                                          _mm_packus_epi32(sums[2], sums[3]));
+        _mm_storeu_si128((__m128i *) &dest[x], packed);
+    }
+    return x;
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256 roundf_avx2(__m256 v){
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    __m256 trunc = _mm256_round_ps(v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m256 frac = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(v, trunc));
+    __m256 step = _mm256_or_ps(_mm256_set1_ps(1.0f), _mm256_and_ps(sign_mask, v));
+    __m256 away = _mm256_cmp_ps(frac, _mm256_set1_ps(0.5f), _CMP_GE_OQ);
+    return _mm256_add_ps(trunc, _mm256_and_ps(away, step));
+}
+
+// Narrows two vectors of 8 int32 (already within 0-255) into 16 ordered bytes
+__attribute__((target("avx2")))
+static inline __m128i pack_16_avx2(__m256i a, __m256i b){
+    // packus works within 128 bit lanes, so restore pixel order before narrowing
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+    __m256i bytes = _mm256_packus_epi16(words, words);
+    return _mm_unpacklo_epi64(_mm256_castsi256_si128(bytes),
+                              _mm256_extracti128_si256(bytes, 1));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i convolve_8_avx2(unsigned char *rows[3], int x,
+                                      __m256 kv[3][3], __m256 div){
+    __m256 cell = _mm256_setzero_ps();
+    for (int ky = 0; ky < 3; ++ky){
+        for (int kx = 0; kx < 3; ++kx){
+            __m128i bytes = _mm_loadl_epi64((__m128i *) &rows[ky][x+kx]);
+            __m256 px = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+            cell = _mm256_add_ps(cell, _mm256_mul_ps(kv[ky][kx], px));
+        }
+    }
+    cell = roundf_avx2(_mm256_div_ps(cell, div));
+    cell = _mm256_min_ps(_mm256_max_ps(cell, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+    return _mm256_cvttps_epi32(cell);
+}
+
+__attribute__((target("avx2")))
+static int convolve_row_3x3_avx2(unsigned char *dest, unsigned char *rows[3],
+                                 struct kernel *k, int count){
+    __m256 kv[3][3];
+    for (int ky = 0; ky < 3; ++ky){
+        for (int kx = 0; kx < 3; ++kx){ kv[ky][kx] = _mm256_set1_ps(k->values[ky][kx]); }
+    }
+    __m256 div = _mm256_set1_ps(k->divisor);
+
+    int x = 0;
+    for (; x < count; x += 16){
+        // A partial last block is shifted back to end at count, recomputing a few pixels
+        if (x + 16 > count){
+            if (count < 16) { break; }
+            x = count - 16;
+        }
+        __m256i a = convolve_8_avx2(rows, x, kv, div);
+        __m256i b = convolve_8_avx2(rows, x+8, kv, div);
+        _mm_storeu_si128((__m128i *) &dest[x], pack_16_avx2(a, b));
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i int_result_avx2(__m256i sum, __m256i d, __m256i n_max, __m256i mul){
+    __m256i n = _mm256_add_epi32(_mm256_add_epi32(sum, sum), d);
+    n = _mm256_min_epi32(_mm256_max_epi32(n, d), n_max);
+    return _mm256_srli_epi32(_mm256_mullo_epi32(n, mul), KERNEL_DIV_SHIFT);
+}
+
+__attribute__((target("avx2")))
+static int convolve_row_3x3_int_avx2(unsigned char *dest, unsigned char *rows[3],
+                                     struct kernel *k, int count){
+    __m256i d = _mm256_set1_epi32(k->idivisor);
+    __m256i n_max = _mm256_set1_epi32(512 * k->idivisor - 1);
+    __m256i mul = _mm256_set1_epi32((int) k->div_mul);
+    int narrow = FITS_INT16(k);
+
+    __m256i kv[3][3];
+    for (int ky = 0; ky < 3; ++ky){
+        for (int kx = 0; kx < 3; ++kx){
+            int val = k->ivalues[ky*3 + kx];
+            kv[ky][kx] = narrow ? _mm256_set1_epi16((short) val) : _mm256_set1_epi32(val);
+        }
+    }
+
+    int x = 0;
+    for (; x < count; x += 16){
+        // A partial last block is shifted back to end at count, recomputing a few pixels
+        if (x + 16 > count){
+            if (count < 16) { break; }
+            x = count - 16;
+        }
+        __m256i lo, hi;
+        if (narrow){
+            // All 16 pixels in a single 16 bit lane vector, widened only to divide
+            __m256i acc = _mm256_setzero_si256();
+            for (int ky = 0; ky < 3; ++ky){
+                for (int kx = 0; kx < 3; ++kx){
+                    // Unaligned, as the taps are offset from the row (see above)
+                    __m128i bytes = _mm_loadu_si128((__m128i *) &rows[ky][x+kx]);
+                    __m256i px = _mm256_cvtepu8_epi16(bytes);
+                    acc = _mm256_add_epi16(acc, _mm256_mullo_epi16(px, kv[ky][kx]));
+                }
+            }
+            lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(acc));
+            hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(acc, 1));
+        }
+        else {
+            lo = _mm256_setzero_si256();
+            hi = _mm256_setzero_si256();
+            for (int ky = 0; ky < 3; ++ky){
+                for (int kx = 0; kx < 3; ++kx){
+                    __m128i bytes_lo = _mm_loadl_epi64((__m128i *) &rows[ky][x+kx]);
+                    __m128i bytes_hi = _mm_loadl_epi64((__m128i *) &rows[ky][x+8+kx]);
+                    lo = _mm256_add_epi32(lo, _mm256_mullo_epi32(
+                                _mm256_cvtepu8_epi32(bytes_lo), kv[ky][kx]));
+                    hi = _mm256_add_epi32(hi, _mm256_mullo_epi32(
+                                _mm256_cvtepu8_epi32(bytes_hi), kv[ky][kx]));
+                }
+            }
+        }
+
+        lo = int_result_avx2(lo, d, n_max, mul);
+        hi = int_result_avx2(hi, d, n_max, mul);
+        _mm_storeu_si128((__m128i *) &dest[x], pack_16_avx2(lo, hi));
+    }
+    return x;
+}
+#endif
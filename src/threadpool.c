@@ -0,0 +1,132 @@
+#include "../include/threadpool.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;  // Signalled when a job is posted or the pool stops
+    pthread_cond_t work_done;   // Signalled when the last band of a job completes
+    pthread_t *workers;
+    int threads;                // Worker count + 1 (the calling thread), 0 before first use
+    int stopping;
+
+    // The current job
+    threadpool_fn fn;
+    void *ctx;
+    int begin, end;
+    int bands;                  // The number of bands the range is split into
+    int next_band;              // The next band to be claimed
+    int pending;                // The number of bands not yet complete
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_ready = PTHREAD_COND_INITIALIZER,
+    .work_done = PTHREAD_COND_INITIALIZER,
+};
+
+// Set on threads currently running a band, making nested parallel loops serial
+static __thread int in_band = 0;
+
+// Claims and runs bands of the current job until none remain.
+// Must be called with the lock held, which is released while each band runs.
+static void run_bands_locked(void){
+    while (pool.next_band < pool.bands){
+        int band = pool.next_band++;
+        threadpool_fn fn = pool.fn;
+        void *ctx = pool.ctx;
+        long len = pool.end - pool.begin;
+        int begin = pool.begin + (int)(len * band / pool.bands);
+        int end = pool.begin + (int)(len * (band + 1) / pool.bands);
+
+        pthread_mutex_unlock(&pool.lock);
+        in_band = 1;
+        fn(ctx, begin, end);
+        in_band = 0;
+        pthread_mutex_lock(&pool.lock);
+
+        if (--pool.pending == 0) { pthread_cond_broadcast(&pool.work_done); }
+    }
+}
+
+static void *worker_main(void *arg){
+    (void) arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;){
+        while (!pool.stopping && pool.next_band >= pool.bands){
+            pthread_cond_wait(&pool.work_ready, &pool.lock);
+        }
+        if (pool.stopping) { break; }
+        run_bands_locked();
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+int threadpool_set_threads(int threads){
+    static int registered = 0;
+    if (!registered) { atexit(threadpool_shutdown); registered = 1; }
+
+    if (threads <= 0) { threads = (int) sysconf(_SC_NPROCESSORS_ONLN); }
+    if (threads <= 0) { threads = 1; }
+    if (threads == pool.threads) { return threads; }
+    threadpool_shutdown();
+
+    if (!(pool.workers = malloc(sizeof(pthread_t) * threads))) {
+        fprintf(stderr, "%s\tFailed to allocate thread pool.\n\t\tRunning single threaded.\n",
+                WARN_TXT);
+        return pool.threads = 1;
+    }
+
+    // The calling thread works on bands too, so it needs one less worker
+    pool.stopping = 0;
+    pool.threads = 1;
+    for (int i = 0; i < threads - 1; ++i){
+        if (pthread_create(&pool.workers[i], NULL, worker_main, NULL)) {
+            fprintf(stderr, "%s\tFailed to start thread %d.\n", WARN_TXT, i+1);
+            break;
+        }
+        pool.threads++;
+    }
+    return pool.threads;
+}
+
+int threadpool_get_threads(void){
+    if (!pool.threads) { threadpool_set_threads(0); }
+    return pool.threads;
+}
+
+void threadpool_run_bands(int begin, int end, threadpool_fn fn, void *ctx){
+    if (end <= begin) { return; }
+    if (in_band || threadpool_get_threads() == 1 || end - begin == 1){
+        fn(ctx, begin, end);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.begin = begin;
+    pool.end = end;
+    pool.bands = MIN(pool.threads, end - begin);
+    pool.next_band = 0;
+    pool.pending = pool.bands;
+    pthread_cond_broadcast(&pool.work_ready);
+
+    run_bands_locked();
+    while (pool.pending) { pthread_cond_wait(&pool.work_done, &pool.lock); }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void threadpool_shutdown(void){
+    if (!pool.workers) { return; }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < pool.threads - 1; ++i){ pthread_join(pool.workers[i], NULL); }
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.threads = 0;
+}
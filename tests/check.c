@@ -0,0 +1,419 @@
+#include "../include/memstats.h"
+#include "../include/processing.h"
+#include "../include/threadpool.h"
+
+// Checks that the filters give identical results however their work is split up, comparing
+// each against the same filter run on the whole image, and that every hysteresis mode
+// matches a plain reference at any thread count, as the streamed Canny matches its stages
+// applied in turn. Also checks that memory stages stay balanced however deep they nest.
+// Run through `make check`.
+// Processing logs its progress to stdout, so results are reported on stderr.
+
+// The budget strips are checked under, small enough to split the images below into many
+#define CHECK_MAX_MEMORY (48 * 1024)
+
+// The thresholds the hysteresis is checked with
+#define CHECK_T1 50
+#define CHECK_T2 20
+
+// The size of the kernel Canny blurs with up to GAUSSIAN_RECURSIVE_SIGMA
+#define CHECK_CANNY_BLUR_SIZE 5
+
+static int checks = 0, failures = 0;
+
+// Creates an image of `pattern`: 0 for a white rectangle on black, 1 for rings and ramps
+// over noise, which leaves plenty of weak edges for the hysteresis to connect
+static struct image *check_image(int width, int height, int pattern){
+    struct image *img = image_create(width, height, 1, 0);
+    if (!img) { return NULL; }
+    unsigned int seed = 12345;
+    for (int y = 0; y < height; ++y){
+        unsigned char *row = image_inner_row(img, y);
+        for (int x = 0; x < width; ++x){
+            if (pattern == 0){
+                int inside = x >= width/5 && x < width*4/5 && y >= height/5 && y < height*4/5;
+                row[x] = inside ? 255 : 0;
+                continue;
+            }
+            seed = seed * 1103515245u + 12345u;
+            int dx = x - width/2, dy = y - height/2;
+            int ring = ((dx*dx + dy*dy) / 97) & 1 ? 60 : 0;
+            int ramp = (x * 96) / width + (y * 64) / height;
+            row[x] = (unsigned char)(ring + ramp + (int)((seed >> 16) % 48));
+        }
+    }
+    return img;
+}
+
+// Creates an image of weak pixels that only connect to the single strong pixel at its end
+// through a long path: a rectangular spiral when `pattern` is 0, or a serpentine winding
+// down and up the image (through every band, many times) when 1
+static struct image *check_path_image(int width, int height, int pattern){
+    struct image *img = image_create(width, height, 1, 0);
+    if (!img) { return NULL; }
+    for (int y = 0; y < height; ++y){ memset(image_inner_row(img, y), 0, width); }
+
+    if (pattern == 0){
+        // Walk inwards along the walls, 2 pixels from the last turn
+        int x0 = 0, y0 = 0, x1 = width - 1, y1 = height - 1, x = 0, y = 0;
+        while (x0 <= x1 && y0 <= y1){
+            for (x = x0; x <= x1; ++x) { image_inner_row(img, y0)[x] = CHECK_T2; }
+            for (y = y0; y <= y1; ++y) { image_inner_row(img, y)[x1] = CHECK_T2; }
+            for (x = x1; x >= x0 && y1 > y0; --x) { image_inner_row(img, y1)[x] = CHECK_T2; }
+            for (y = y1; y >= y0 + 2 && x1 > x0; --y) { image_inner_row(img, y)[x0] = CHECK_T2; }
+            x0 += 2; y0 += 2; x1 -= 2; y1 -= 2;
+            if (x0 <= x1 && y0 <= y1) { image_inner_row(img, y0)[x0 - 1] = CHECK_T2; }
+        }
+        image_inner_row(img, 0)[0] = CHECK_T1;
+        return img;
+    }
+
+    // Columns 2 apart, joined alternately at the bottom and top, with a diagonal step
+    for (int x = 0; x < width; x += 2){
+        for (int y = 1; y < height - 1; ++y) { image_inner_row(img, y)[x] = CHECK_T2; }
+        if (x + 2 < width){
+            int join = (x / 2) % 2 ? 0 : height - 1;
+            image_inner_row(img, join)[x + 1] = CHECK_T2;
+        }
+    }
+    image_inner_row(img, 1)[0] = CHECK_T1;
+    return img;
+}
+
+// A plain hysteresis to check against: pixels of at least t2 next to a kept pixel are
+// kept, sweeping the image until nothing changes
+static void check_reference_hysteresis(struct image *img, unsigned char t1, unsigned char t2){
+    int inner_w = img->width - img->padding*2, inner_h = img->height - img->padding*2;
+    // 2 for kept, 1 for weak and not yet kept, 0 for discarded
+    unsigned char *state = malloc((size_t) inner_w * inner_h);
+    if (!state) { return; }
+    for (int y = 0; y < inner_h; ++y){
+        unsigned char *row = image_inner_row(img, y);
+        for (int x = 0; x < inner_w; ++x){
+            state[(size_t) y * inner_w + x] = row[x] >= t1 ? 2 : row[x] >= t2 ? 1 : 0;
+        }
+    }
+
+    int changed = 1;
+    while (changed){
+        changed = 0;
+        for (int y = 0; y < inner_h; ++y){
+            for (int x = 0; x < inner_w; ++x){
+                unsigned char *cell = &state[(size_t) y * inner_w + x];
+                if (*cell != 1) { continue; }
+                for (int n = 0; n < 9 && *cell == 1; ++n){
+                    int nx = x + n % 3 - 1, ny = y + n / 3 - 1;
+                    if (nx < 0 || ny < 0 || nx >= inner_w || ny >= inner_h) { continue; }
+                    if (state[(size_t) ny * inner_w + nx] == 2) { *cell = 2; changed = 1; }
+                }
+            }
+        }
+    }
+
+    for (int y = 0; y < inner_h; ++y){
+        unsigned char *row = image_inner_row(img, y);
+        for (int x = 0; x < inner_w; ++x){
+            row[x] = state[(size_t) y * inner_w + x] == 2 ? 255 : 0;
+        }
+    }
+    free(state);
+}
+
+// Reports whether the inner images of a and b are identical
+static void check_same(const char *name, struct image *a, struct image *b){
+    int inner_w = a->width - a->padding*2, inner_h = a->height - a->padding*2;
+    size_t diffs = 0;
+    for (int y = 0; y < inner_h; ++y){
+        unsigned char *row_a = image_inner_row(a, y), *row_b = image_inner_row(b, y);
+        for (int x = 0; x < inner_w; ++x){ diffs += row_a[x] != row_b[x]; }
+    }
+    checks++;
+    if (diffs){
+        failures++;
+        fprintf(stderr, "FAIL\t%s: %zu pixels differ\n", name, diffs);
+    }
+}
+
+// The filters checked, with fixed arguments
+struct check_filter {
+    const char *name;
+    int (*apply)(struct image *img);
+};
+
+static int check_sobel(struct image *img) { return filter_sobel(img, 0); }
+static int check_sobel_thinned(struct image *img) { return filter_sobel(img, 1); }
+static int check_scharr(struct image *img) { return filter_scharr(img, 0); }
+static int check_cross(struct image *img) { return filter_cross(img); }
+static int check_canny_0(struct image *img) { return filter_canny(img, 0.0, 50, 20); }
+static int check_canny_1(struct image *img) { return filter_canny(img, 1.0, 50, 20); }
+static int check_canny_3(struct image *img) { return filter_canny(img, 3.0, 50, 20); }
+static int check_canny_unthresholded(struct image *img) { return filter_canny(img, 1.0, 0, 0); }
+static int check_canny_auto(struct image *img) { return filter_canny_auto(img, 1.0, NULL, NULL); }
+
+static const struct check_filter filters[] = {
+    { "sobel", check_sobel },
+    { "sobel thinned", check_sobel_thinned },
+    { "scharr", check_scharr },
+    { "cross", check_cross },
+    { "canny 0", check_canny_0 },
+    { "canny 1", check_canny_1 },
+    { "canny 3", check_canny_3 },
+    { "canny unthresholded", check_canny_unthresholded },
+    { "canny auto", check_canny_auto },
+};
+
+// Applies a filter to a copy of src, NULL on failure
+static struct image *check_apply(const struct check_filter *filter, struct image *src){
+    struct image *img = image_clone(src);
+    if (img && !filter->apply(img)) { image_free(img); img = NULL; }
+    return img;
+}
+
+// The border modes checked
+static const char *borders[] = {
+    [BORDER_CONSTANT] = "constant", [BORDER_REPLICATE] = "replicate",
+    [BORDER_REFLECT] = "reflect", [BORDER_WRAP] = "wrap",
+};
+
+// Checks every filter under a memory budget against the same filter without one. Strips
+// cannot wrap around the image, so BORDER_WRAP is left out.
+static void check_strips(struct image *src, const char *image_name){
+    for (int b = 0; b < BORDER_WRAP; ++b){
+        processing_set_border((enum border_mode) b);
+        for (int f = 0; f < (int)(sizeof(filters)/sizeof(*filters)); ++f){
+            char name[128];
+            snprintf(name, sizeof(name), "%s, %s border, %s under a budget",
+                     image_name, borders[b], filters[f].name);
+
+            processing_set_max_memory(0);
+            struct image *whole = check_apply(&filters[f], src);
+            processing_set_max_memory(CHECK_MAX_MEMORY);
+            struct image *strips = check_apply(&filters[f], src);
+            processing_set_max_memory(0);
+
+            if (!whole || !strips){
+                checks++; failures++;
+                fprintf(stderr, "FAIL\t%s: filter failed\n", name);
+            }
+            else { check_same(name, whole, strips); }
+            if (whole) { image_free(whole); }
+            if (strips) { image_free(strips); }
+        }
+    }
+    processing_set_border(BORDER_CONSTANT);
+}
+
+// The hysteresis modes and thread counts checked
+static const char *modes[] = {
+    [HYSTERESIS_FLOOD] = "flood", [HYSTERESIS_UNION_FIND] = "union-find",
+    [HYSTERESIS_DILATE] = "dilate",
+};
+static const int threads[] = { 1, 2, 3, 5, 8 };
+
+// Checks every hysteresis mode at several thread counts against the reference
+static void check_hysteresis(struct image *src, const char *image_name){
+    struct image *reference = image_clone(src);
+    if (!reference) { checks++; failures++; return; }
+    check_reference_hysteresis(reference, CHECK_T1, CHECK_T2);
+
+    for (int m = 0; m < (int)(sizeof(modes)/sizeof(*modes)); ++m){
+        processing_set_hysteresis((enum hysteresis_mode) m);
+        for (int t = 0; t < (int)(sizeof(threads)/sizeof(*threads)); ++t){
+            char name[128];
+            snprintf(name, sizeof(name), "%s, %s hysteresis with %d threads",
+                     image_name, modes[m], threads[t]);
+            threadpool_set_threads(threads[t]);
+            struct image *img = image_clone(src);
+            if (!img || !filter_hysteresis_threshold(img, CHECK_T1, CHECK_T2)){
+                checks++; failures++;
+                fprintf(stderr, "FAIL\t%s: filter failed\n", name);
+            }
+            else { check_same(name, reference, img); }
+            if (img) { image_free(img); }
+        }
+    }
+    processing_set_hysteresis(HYSTERESIS_FLOOD);
+    threadpool_set_threads(0);
+    image_free(reference);
+}
+
+// Checks the Canny filters under every hysteresis mode at several thread counts against
+// the same filter flooding on a single thread
+static void check_canny_hysteresis(struct image *src, const char *image_name){
+    for (int f = 0; f < (int)(sizeof(filters)/sizeof(*filters)); ++f){
+        if (strncmp(filters[f].name, "canny", 5)) { continue; }
+        processing_set_hysteresis(HYSTERESIS_FLOOD);
+        threadpool_set_threads(1);
+        struct image *reference = check_apply(&filters[f], src);
+        if (!reference) { checks++; failures++; continue; }
+
+        for (int m = 0; m < (int)(sizeof(modes)/sizeof(*modes)); ++m){
+            processing_set_hysteresis((enum hysteresis_mode) m);
+            for (int t = 0; t < (int)(sizeof(threads)/sizeof(*threads)); ++t){
+                char name[128];
+                snprintf(name, sizeof(name), "%s, %s with %s hysteresis and %d threads",
+                         image_name, filters[f].name, modes[m], threads[t]);
+                threadpool_set_threads(threads[t]);
+                struct image *img = check_apply(&filters[f], src);
+                if (!img){
+                    checks++; failures++;
+                    fprintf(stderr, "FAIL\t%s: filter failed\n", name);
+                }
+                else { check_same(name, reference, img); image_free(img); }
+            }
+        }
+        image_free(reference);
+    }
+    processing_set_hysteresis(HYSTERESIS_FLOOD);
+    threadpool_set_threads(0);
+}
+
+// Applies Canny to a copy of src as its stages in turn, through the public filters,
+// with thresholds t1 and t2. NULL on failure.
+static struct image *check_canny_staged(struct image *src, float sigma, 
+                                        unsigned char t1, unsigned char t2){
+    struct image *img = image_clone(src);
+    if (!img) { return NULL; }
+    if ((sigma > 0.0 && !filter_gaussian(img, CHECK_CANNY_BLUR_SIZE, sigma)) || 
+        !filter_sobel(img, 1) || !filter_hysteresis_threshold(img, t1, t2)){
+        image_free(img);
+        return NULL;
+    }
+    return img;
+}
+
+// Checks the streamed Canny, with given and chosen thresholds, against its stages applied
+// in turn, under every border, hysteresis mode and several thread counts
+static void check_canny_stream(struct image *src, const char *image_name){
+    static const float sigmas[] = { 0.0, 1.0 };
+    for (int b = 0; b < (int)(sizeof(borders)/sizeof(*borders)); ++b){
+        processing_set_border((enum border_mode) b);
+        for (int m = 0; m < (int)(sizeof(modes)/sizeof(*modes)); ++m){
+            processing_set_hysteresis((enum hysteresis_mode) m);
+            for (int t = 0; t < (int)(sizeof(threads)/sizeof(*threads)); ++t){
+                threadpool_set_threads(threads[t]);
+                for (int s = 0; s < (int)(sizeof(sigmas)/sizeof(*sigmas)); ++s){
+                    for (int chosen = 0; chosen < 2; ++chosen){
+                        char name[128];
+                        snprintf(name, sizeof(name), 
+                                 "%s, %s border, canny %s %.0f against its stages, "
+                                 "%s hysteresis with %d threads", image_name, borders[b], 
+                                 chosen ? "auto" : "given", sigmas[s], modes[m], threads[t]);
+
+                        unsigned char t1 = CHECK_T1, t2 = CHECK_T2;
+                        struct image *streamed = image_clone(src);
+                        int success = streamed && (chosen 
+                            ? filter_canny_auto(streamed, sigmas[s], &t1, &t2)
+                            : filter_canny(streamed, sigmas[s], t1, t2));
+                        struct image *staged = success 
+                            ? check_canny_staged(src, sigmas[s], t1, t2) : NULL;
+                        if (!success || !staged){
+                            checks++; failures++;
+                            fprintf(stderr, "FAIL\t%s: filter failed\n", name);
+                        }
+                        else { check_same(name, staged, streamed); }
+                        if (streamed) { image_free(streamed); }
+                        if (staged) { image_free(staged); }
+                    }
+                }
+            }
+        }
+    }
+    processing_set_border(BORDER_CONSTANT);
+    processing_set_hysteresis(HYSTERESIS_FLOOD);
+    threadpool_set_threads(0);
+}
+
+// Checks that the thresholds chosen for a nearly flat image, three grey levels a step
+// apart, keep only the edges between them rather than the whole image
+static void check_canny_auto_flat(void){
+    struct image *img = image_create(200, 150, 1, 0);
+    if (!img) { checks++; failures++; return; }
+    for (int y = 0; y < 150; ++y){
+        unsigned char *row = image_inner_row(img, y);
+        for (int x = 0; x < 200; ++x){ row[x] = (unsigned char)(10 + x / 70); }
+    }
+
+    unsigned char t1 = 0, t2 = 0;
+    processing_set_border(BORDER_REPLICATE);
+    int success = filter_canny_auto(img, 1.0, &t1, &t2);
+    processing_set_border(BORDER_CONSTANT);
+
+    size_t stray = 0;
+    for (int y = 0; y < 150 && success; ++y){
+        unsigned char *row = image_inner_row(img, y);
+        for (int x = 0; x < 200; ++x){ stray += row[x] && abs(x % 70 - 35) < 30; }
+    }
+    checks++;
+    if (!success || t2 < 1 || t1 <= t2 || stray){
+        failures++;
+        fprintf(stderr, "FAIL\tcanny auto on a flat step: thresholds %u and %u, "
+                "%zu pixels away from the edges\n", t1, t2, stray);
+    }
+    image_free(img);
+}
+
+// Checks that stages nested deeper than can be recorded are popped without ending the
+// ones recorded, so that allocations after them go to the stage they were nested in
+static void check_mem_stats_overflow(void){
+    mem_stats_push("check outer");
+    for (int i = 0; i < MEM_STATS_MAX_STAGES + 2; ++i){ mem_stats_push("check nested"); }
+    for (int i = 0; i < MEM_STATS_MAX_STAGES + 2; ++i){ mem_stats_pop(); }
+
+    struct mem_stats before, after;
+    mem_stats_get(&before);
+    void *ptr = mem_malloc(64);
+    mem_stats_get(&after);
+    mem_free(ptr);
+    mem_stats_pop();
+
+    size_t outer = 0;
+    for (int i = 0; i < after.stages; ++i){
+        if (!strcmp(after.stage[i].name, "check outer")){
+            outer = after.stage[i].allocs - before.stage[i].allocs;
+        }
+    }
+    checks++;
+    if (outer != 1){
+        failures++;
+        fprintf(stderr, "FAIL\tmemory stages nested too deep: the outer stage was ended\n");
+    }
+}
+
+int main(void){
+    if (!freopen("/dev/null", "w", stdout)) { return EXIT_FAILURE; }
+
+    struct image *rect = check_image(200, 150, 0), *rings = check_image(320, 240, 1);
+    if (!rect || !rings){
+        fprintf(stderr, "FAIL\tCould not create the test images.\n");
+        return EXIT_FAILURE;
+    }
+
+    check_strips(rect, "rectangle");
+    check_strips(rings, "rings");
+
+    // The hysteresis is checked on thinned edges, and on paths winding through the image
+    struct image *edges = image_clone(rings);
+    struct image *spiral = check_path_image(150, 110, 0);
+    struct image *serpentine = check_path_image(203, 131, 1);
+    if (!edges || !spiral || !serpentine || !filter_sobel(edges, 1)){
+        fprintf(stderr, "FAIL\tCould not create the test images.\n");
+        return EXIT_FAILURE;
+    }
+    check_hysteresis(edges, "rings edges");
+    check_hysteresis(spiral, "spiral");
+    check_hysteresis(serpentine, "serpentine");
+    check_canny_hysteresis(rings, "rings");
+    check_canny_stream(rings, "rings");
+    check_canny_auto_flat();
+    check_mem_stats_overflow();
+
+    image_free(rect);
+    image_free(rings);
+    image_free(edges);
+    image_free(spiral);
+    image_free(serpentine);
+    threadpool_shutdown();
+    fprintf(stderr, "%d of %d checks passed.\n", checks - failures, checks);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}